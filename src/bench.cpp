@@ -0,0 +1,212 @@
+
+#include "fs.h"
+#include "disk.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/*
+Escalabilidade com threads: para 1, 2, 4, ... ate maxthreads, cada thread
+escreve o proprio arquivo e depois o le inteiro algumas vezes, por handles;
+os arquivos sao apagados antes da rodada seguinte. Mostra a vazao total de
+cada fase, e quanto ela cresceu em relacao a uma thread so. O disco eh
+formatado no comeco, entao por padrao ele fica so na memoria; com -b file ou
+-b mmap a imagem tem que ser nova ou vazia.
+*/
+#define BENCH_CHUNK  (64*1024)
+#define BENCH_PASSES 4
+
+struct bench_thread {
+	pthread_t thread;
+	int inumber;
+	int size;
+	int ok;
+};
+
+static pthread_barrier_t barrier;
+static int reading;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void *bench_run( void *arg )
+{
+	struct bench_thread *t = (struct bench_thread *) arg;
+	char *buffer = (char *) malloc(BENCH_CHUNK);
+	int fd, offset, pass, result;
+
+	t->ok = buffer!=0;
+	fd = fs_open(t->inumber);
+	if(fd<0) t->ok = 0;
+
+	pthread_barrier_wait(&barrier);
+	if(t->ok && !reading) {
+		memset(buffer,t->inumber,BENCH_CHUNK);
+		for(offset=0;offset<t->size && t->ok;offset+=BENCH_CHUNK) {
+			if(fs_pwrite(fd,buffer,BENCH_CHUNK,offset)!=BENCH_CHUNK) t->ok = 0;
+		}
+	} else if(t->ok) {
+		for(pass=0;pass<BENCH_PASSES && t->ok;pass++) {
+			for(offset=0;offset<t->size;offset+=result) {
+				result = fs_pread(fd,buffer,BENCH_CHUNK,offset);
+				if(result<=0 || buffer[0]!=(char)t->inumber) {
+					t->ok = 0;
+					break;
+				}
+			}
+		}
+	}
+	pthread_barrier_wait(&barrier);
+
+	if(fd>=0) fs_close(fd);
+	free(buffer);
+	return 0;
+}
+
+/* roda uma fase com n threads e devolve a vazao em MB/s, ou -1 se algo falhou */
+static double bench_phase( struct bench_thread *threads, int n, int read )
+{
+	double start, elapsed, bytes;
+	int i, ok = 1;
+
+	reading = read;
+	pthread_barrier_init(&barrier,0,n+1);
+	for(i=0;i<n;i++) pthread_create(&threads[i].thread,0,bench_run,&threads[i]);
+
+	pthread_barrier_wait(&barrier);
+	start = now();
+	pthread_barrier_wait(&barrier);
+	if(!read) fs_sync();
+	elapsed = now()-start;
+
+	for(i=0;i<n;i++) {
+		pthread_join(threads[i].thread,0);
+		if(!threads[i].ok) ok = 0;
+	}
+	pthread_barrier_destroy(&barrier);
+
+	bytes = (double)n*threads[0].size*(read ? BENCH_PASSES : 1);
+	return ok ? bytes/elapsed/(1024*1024) : -1;
+}
+
+int main( int argc, char *argv[] )
+{
+	struct bench_thread *threads;
+	double write1 = 0, read1 = 0, write, read;
+	int nbuffers = CACHE_DEFAULT_BUFFERS;
+	int mode = DISK_MODE_RAM;
+	int model = DISK_MODEL_NONE;
+	int maxthreads, size, n, i, opt;
+	struct stat st;
+
+	while((opt=getopt(argc,argv,"b:c:t:"))!=-1) {
+		switch(opt) {
+			case 'b':
+				if(!strcmp(optarg,"file")) mode = DISK_MODE_FILE;
+				else if(!strcmp(optarg,"mmap")) mode = DISK_MODE_MMAP;
+				else if(!strcmp(optarg,"ram")) mode = DISK_MODE_RAM;
+				else argc = 0;
+				break;
+			case 'c':
+				nbuffers = atoi(optarg);
+				break;
+			case 't':
+				if(!strcmp(optarg,"none")) model = DISK_MODEL_NONE;
+				else if(!strcmp(optarg,"hdd")) model = DISK_MODEL_HDD;
+				else if(!strcmp(optarg,"ssd")) model = DISK_MODEL_SSD;
+				else argc = 0;
+				break;
+			default:
+				argc = 0;
+				break;
+		}
+	}
+
+	if(argc-optind!=4) {
+		printf("use: %s [-b ram|file|mmap] [-c nbuffers] [-t none|hdd|ssd] <diskfile> <nblocks> <maxthreads> <filekb>\n",argv[0]);
+		printf("the disk is formatted; with file or mmap, diskfile must not exist or be empty\n");
+		return 1;
+	}
+
+	maxthreads = atoi(argv[optind+2]);
+	size = atoi(argv[optind+3])*1024;
+	size -= size%BENCH_CHUNK;
+	if(maxthreads<1 || size<=0) {
+		printf("maxthreads must be at least 1 and filekb at least %d\n",BENCH_CHUNK/1024);
+		return 1;
+	}
+
+	if(mode!=DISK_MODE_RAM && stat(argv[optind],&st)==0 && st.st_size>0) {
+		printf("%s is not empty, refusing to format it\n",argv[optind]);
+		return 1;
+	}
+
+	if(!disk_init(argv[optind],atoi(argv[optind+1]),mode)) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+
+	disk_set_model(model);
+
+	if(!cache_init(nbuffers)) {
+		printf("couldn't create a cache with %d buffers\n",nbuffers);
+		disk_close();
+		return 1;
+	}
+
+	threads = (struct bench_thread *) calloc(maxthreads,sizeof(struct bench_thread));
+	if(!threads) {
+		printf("out of memory\n");
+		return 1;
+	}
+
+	if(!fs_format(FS_FORMAT_FAST) || !fs_mount()) {
+		printf("couldn't format and mount %s\n",argv[optind]);
+		free(threads);
+		cache_close();
+		disk_close();
+		return 1;
+	}
+
+	printf("%d KB per thread, %d read passes\n",size/1024,BENCH_PASSES);
+	printf("threads   write MB/s  speedup    read MB/s  speedup\n");
+
+	for(n=1;;n=n*2<maxthreads ? n*2 : maxthreads) {
+		for(i=0;i<n;i++) {
+			threads[i].inumber = fs_create();
+			threads[i].size = size;
+		}
+
+		write = bench_phase(threads,n,0);
+		read = bench_phase(threads,n,1);
+		for(i=0;i<n;i++) fs_delete(threads[i].inumber);
+		if(write<0 || read<0) {
+			printf("%7d   failed, is the disk big enough?\n",n);
+			break;
+		}
+		if(n==1) {
+			write1 = write;
+			read1 = read;
+		}
+		printf("%7d   %10.1f  %6.2fx   %10.1f  %6.2fx\n",n,write,write/write1,read,read/read1);
+
+		if(n==maxthreads) break;
+	}
+
+	free(threads);
+	cache_close();
+	disk_close();
+
+	return 0;
+}
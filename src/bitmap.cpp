@@ -0,0 +1,224 @@
+
+#include <algorithm>
+
+#include "bitmap.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BITMAP_AVX2 1
+#include <immintrin.h>
+#endif
+
+static const uint64_t FULL_WORD = ~(uint64_t)0;
+
+/* pula as palavras cheias em [from,to), retorna a primeira com bit livre ou to */
+static int skip_full_plain( const uint64_t *words, int from, int to )
+{
+	while(from<to && words[from]==FULL_WORD) from++;
+	return from;
+}
+
+#ifdef BITMAP_AVX2
+/* o mesmo, mas testando 256 bits por vez */
+__attribute__((target("avx2")))
+static int skip_full_avx2( const uint64_t *words, int from, int to )
+{
+	const __m256i ones = _mm256_set1_epi64x(-1);
+
+	while(from+4<=to) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(words+from));
+		if(!_mm256_testc_si256(v,ones)) break;
+		from += 4;
+	}
+
+	return skip_full_plain(words,from,to);
+}
+#endif
+
+static int skip_full( const uint64_t *words, int from, int to )
+{
+#ifdef BITMAP_AVX2
+	// a escolha eh feita uma vez so, conforme o processador
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	if(avx2) return skip_full_avx2(words,from,to);
+#endif
+	return skip_full_plain(words,from,to);
+}
+
+void bitmap::assign( int n, int value )
+{
+	int nwords = (n+BITMAP_WORD_BITS-1)/BITMAP_WORD_BITS;
+	int ngroups = (nwords+BITMAP_GROUP_WORDS-1)/BITMAP_GROUP_WORDS;
+	int i;
+
+	nbits = n;
+	words.assign(nwords,value ? FULL_WORD : 0);
+	groupfree.assign(ngroups,0);
+	groupdirty.assign(ngroups,0);
+	hint = 0;
+
+	// os bits depois do fim ficam ocupados, para a busca nunca devolver um deles
+	if(n%BITMAP_WORD_BITS)
+		words[nwords-1] |= FULL_WORD << (n%BITMAP_WORD_BITS);
+
+	nfree = value ? 0 : n;
+	if(!value) {
+		for(i=0;i<ngroups;i++)
+			groupfree[i] = std::min(BITMAP_GROUP_BITS,n-i*BITMAP_GROUP_BITS);
+	}
+}
+
+void bitmap::load( int n, const uint64_t *src )
+{
+	int i;
+
+	assign(n,0);
+	std::copy(src,src+words.size(),words.begin());
+	if(n%BITMAP_WORD_BITS)
+		words.back() |= FULL_WORD << (n%BITMAP_WORD_BITS);
+
+	for(i=0;i<(int)words.size();i++) {
+		int used = __builtin_popcountll(words[i]);
+		if(i==(int)words.size()-1 && n%BITMAP_WORD_BITS)
+			used -= BITMAP_WORD_BITS - n%BITMAP_WORD_BITS;
+		groupfree[i/BITMAP_GROUP_WORDS] -= used;
+		nfree -= used;
+	}
+}
+
+void bitmap::merge( const bitmap &other )
+{
+	int i;
+
+	for(i=0;i<(int)words.size();i++) {
+		uint64_t added = other.words[i] & ~words[i];
+		if(!added) continue;
+
+		int n = __builtin_popcountll(added);
+		words[i] |= added;
+		groupfree[i/BITMAP_GROUP_WORDS] -= n;
+		groupdirty[i/BITMAP_GROUP_WORDS] = 1;
+		nfree -= n;
+	}
+}
+
+void bitmap::update( int i, int value )
+{
+	uint64_t &word = words[i/BITMAP_WORD_BITS];
+	uint64_t mask = (uint64_t)1 << (i%BITMAP_WORD_BITS);
+	int group = i/BITMAP_GROUP_BITS;
+
+	if(((word & mask)!=0) == (value!=0)) return;
+
+	groupdirty[group] = 1;
+
+	if(value) {
+		word |= mask;
+		groupfree[group]--;
+		nfree--;
+	} else {
+		word &= ~mask;
+		groupfree[group]++;
+		nfree++;
+		if(group<hint) hint = group;
+	}
+}
+
+int bitmap::find_free( int start ) const
+{
+	int ngroups = groupfree.size();
+	int nwords = words.size();
+	int group;
+
+	if(start<0) start = 0;
+	if(start>=nbits || nfree==0) return -1;
+
+	while(hint<ngroups && groupfree[hint]==0) hint++;
+
+	group = start/BITMAP_GROUP_BITS;
+	if(group<hint) {
+		group = hint;
+		start = group*BITMAP_GROUP_BITS;
+	}
+
+	for(;group<ngroups;group++) {
+		if(groupfree[group]==0) continue;
+
+		int first = std::max(start,group*BITMAP_GROUP_BITS);
+		int w = first/BITMAP_WORD_BITS;
+		int end = std::min((group+1)*BITMAP_GROUP_WORDS,nwords);
+
+		// a primeira palavra pode comecar no meio
+		if(first%BITMAP_WORD_BITS) {
+			uint64_t word = words[w] | ((FULL_WORD >> (BITMAP_WORD_BITS - first%BITMAP_WORD_BITS)));
+			if(word!=FULL_WORD) return w*BITMAP_WORD_BITS + __builtin_ctzll(~word);
+			w++;
+		}
+
+		w = skip_full(words.data(),w,end);
+		if(w<end) return w*BITMAP_WORD_BITS + __builtin_ctzll(~words[w]);
+	}
+
+	return -1;
+}
+
+int bitmap::alloc( int start )
+{
+	int i = find_free(start);
+	if(i>=0) set(i);
+	return i;
+}
+
+int bitmap::find_free_run( int start, int length ) const
+{
+	int i = find_free(start);
+
+	while(i>=0) {
+		int j = i;
+
+		while(j<nbits && j-i<length) {
+			uint64_t word = words[j/BITMAP_WORD_BITS];
+			if(j%BITMAP_WORD_BITS==0 && word==0) j += BITMAP_WORD_BITS;
+			else if((word >> (j%BITMAP_WORD_BITS)) & 1) break;
+			else j++;
+		}
+
+		if(std::min(j,nbits)-i>=length) return i;
+		if(j>=nbits) return -1;
+		i = find_free(j);
+	}
+
+	return -1;
+}
+
+int bitmap::largest_free_run( int begin, int end, int &start ) const
+{
+	int best = 0, run = 0, i = std::max(begin,0);
+
+	start = -1;
+	end = std::min(end,nbits);
+
+	while(i<end) {
+		uint64_t word = words[i/BITMAP_WORD_BITS];
+
+		// palavras inteiras cheias ou vazias andam de uma vez
+		if(i%BITMAP_WORD_BITS==0 && i+BITMAP_WORD_BITS<=end && (word==0 || word==FULL_WORD)) {
+			if(word==0) {
+				run += BITMAP_WORD_BITS;
+			} else {
+				run = 0;
+			}
+			i += BITMAP_WORD_BITS;
+		} else {
+			if((word >> (i%BITMAP_WORD_BITS)) & 1) run = 0;
+			else run++;
+			i++;
+		}
+
+		if(run>best) {
+			best = run;
+			start = i-run;
+		}
+	}
+
+	return best;
+}
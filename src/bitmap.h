@@ -0,0 +1,69 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+#include <vector>
+
+/*
+Mapa de bits compacto, um bit por bloco ou inodo (1 = ocupado), 64 por palavra.
+
+Os bits sao divididos em grupos de BITMAP_GROUP_BITS, e cada grupo guarda
+quantos bits livres tem. A busca pula os grupos cheios sem olhar as palavras,
+e dentro do grupo acha o bit livre com count-trailing-zeros. O total de livres
+eh mantido em dia a cada set/clear.
+*/
+
+#define BITMAP_WORD_BITS   64
+#define BITMAP_GROUP_WORDS 64
+#define BITMAP_GROUP_BITS  (BITMAP_WORD_BITS*BITMAP_GROUP_WORDS)
+
+class bitmap {
+	std::vector<uint64_t> words;
+	std::vector<int> groupfree;	// bits livres em cada grupo
+	std::vector<char> groupdirty;	// grupos alterados desde o ultimo clean()
+	int nbits;
+	int nfree;
+	mutable int hint;		// nenhum grupo antes deste tem bit livre
+
+	void update( int i, int value );
+public:
+	bitmap() : nbits(0), nfree(0), hint(0) {}
+
+	// redimensiona para n bits, todos com o valor dado
+	void assign( int n, int value );
+
+	// redimensiona para n bits copiados de palavras lidas do disco
+	void load( int n, const uint64_t *src );
+
+	// marca como ocupados os bits ocupados em other, que deve ter o mesmo tamanho
+	void merge( const bitmap &other );
+
+	int size() const { return nbits; }
+	int free_count() const { return nfree; }
+	int group_count() const { return groupfree.size(); }
+	int group_free( int group ) const { return groupfree[group]; }
+
+	int operator[]( int i ) const { return (words[i/BITMAP_WORD_BITS] >> (i%BITMAP_WORD_BITS)) & 1; }
+	void set( int i ) { update(i,1); }
+	void clear( int i ) { update(i,0); }
+
+	// palavras cruas, para gravar no disco
+	const uint64_t *data() const { return words.data(); }
+	int word_count() const { return words.size(); }
+	bool group_dirty( int group ) const { return groupdirty[group]; }
+	void clean() { groupdirty.assign(groupdirty.size(),0); }
+
+	// primeiro bit livre a partir de start, ou -1
+	int find_free( int start = 0 ) const;
+
+	// acha um bit livre a partir de start e marca como ocupado, ou -1
+	int alloc( int start = 0 );
+
+	// inicio da primeira sequencia de length bits livres a partir de start, ou -1
+	int find_free_run( int start, int length ) const;
+
+	// maior sequencia de bits livres em [begin,end); devolve o tamanho e o inicio em start
+	int largest_free_run( int begin, int end, int &start ) const;
+};
+
+#endif
@@ -0,0 +1,579 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "disk.h"
+#include "cache.h"
+
+/*
+Cache de blocos write-back entre o fs e o disco simulado.
+
+Cada buffer guarda uma copia de um bloco do disco. Escritas apenas marcam o
+buffer como sujo; o bloco so vai para o disco quando o buffer eh escolhido
+para substituicao (algoritmo do relogio / CLOCK) ou em cache_sync().
+
+Quando um buffer sujo precisa ser substituido, todos os buffers sujos sao
+gravados de uma vez, em ordem de bloco, pelo motor assincrono do disco.
+
+Com nbuffers == 0 o cache fica desligado e tudo vai direto para o disco.
+
+cache_prefetch() eh a leitura antecipada: os blocos pedidos ganham buffers e
+a leitura vai para o disco sem esperar (disk_start). Esses buffers ficam
+marcados como carregando ate o proximo disk_wait(); quem precisar de um deles
+antes disso espera o disco (settle). Os blocos antecipados que chegam a ser
+lidos contam como acertos da leitura antecipada, os substituidos sem uso como
+desperdicio.
+
+cache_pin_blocks() entrega ponteiros para os proprios buffers, sem copiar; um
+buffer fixado nao eh substituido ate cache_unpin(). No maximo metade dos
+buffers fica fixada, para o relogio sempre achar uma vitima.
+
+Todas as funcoes podem ser chamadas por varias threads. Os dados do cache
+ficam sob cache_lock, mas a leitura de um bloco que falta nao: o buffer fica
+marcado como sendo lido, sai do relogio, e a thread le do disco pelo motor
+assincrono, sem o lock. Outra thread que precise desse bloco no meio tempo le
+ela mesma do disco, ou, se for escrever, espera a leitura terminar
+(cache_done). Se
+todos os buffers estiverem fixados ou sendo lidos, o acesso passa direto ao
+disco, sem cache.
+*/
+
+struct cache_buffer {
+	int blocknum;
+	int dirty;
+	int referenced;
+	int loading;		// leitura antecipada ainda em voo
+	int prefetched;		// trazido pela leitura antecipada e ainda nao lido
+	int pinned;		// referencias entregues por cache_pin_blocks
+	int reading;		// uma thread esta lendo o bloco do disco sem o lock
+	char data[DISK_BLOCK_SIZE];
+};
+
+static struct cache_buffer *buffers=0;
+static int *lookup=0;		// bloco do disco -> indice do buffer, ou -1
+static int *flushlist=0;	// rascunho para ordenar os buffers sujos
+static int nbuffers=0;
+static int nused=0;
+static int hand=0;
+static int nhits=0;
+static int nmisses=0;
+static int nwritebacks=0;
+static int nloading=0;		// buffers com leitura antecipada em voo
+static int npinned=0;		// buffers fixados
+static int nprefetches=0;	// pedidos de leitura antecipada
+static int nprefetched=0;	// blocos lidos antecipadamente
+static int nprefetchhits=0;
+static int nprefetchwasted=0;
+static int nprefetchpending=0;	// buffers antecipados ainda nao lidos, de todas as threads
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_done = PTHREAD_COND_INITIALIZER;	// algum buffer deixou de estar sendo lido
+
+int cache_init( int n )
+{
+	int i;
+
+	if(n<0) return 0;
+
+	nbuffers = n;
+	nused = 0;
+	hand = 0;
+	nhits = 0;
+	nmisses = 0;
+	nwritebacks = 0;
+	nloading = 0;
+	npinned = 0;
+	nprefetches = 0;
+	nprefetched = 0;
+	nprefetchhits = 0;
+	nprefetchwasted = 0;
+	nprefetchpending = 0;
+
+	if(nbuffers==0) return 1;
+
+	buffers = (struct cache_buffer *) malloc(nbuffers*sizeof(struct cache_buffer));
+	lookup = (int *) malloc(disk_size()*sizeof(int));
+	flushlist = (int *) malloc(nbuffers*sizeof(int));
+	if(!buffers || !lookup || !flushlist) {
+		free(buffers);
+		free(lookup);
+		free(flushlist);
+		buffers = 0;
+		lookup = 0;
+		flushlist = 0;
+		nbuffers = 0;
+		return 0;
+	}
+
+	for(i=0;i<disk_size();i++) lookup[i] = -1;
+
+	return 1;
+}
+
+static int compare_blocknum( const void *a, const void *b )
+{
+	return buffers[*(const int *)a].blocknum - buffers[*(const int *)b].blocknum;
+}
+
+/* espera as leituras antecipadas em voo, para os buffers poderem ser usados */
+static void settle()
+{
+	int i;
+
+	if(nloading==0) return;
+
+	disk_wait();
+	for(i=0;i<nused;i++) buffers[i].loading = 0;
+	nloading = 0;
+}
+
+/* o buffer foi lido: se veio da leitura antecipada, ela acertou */
+static void touch( struct cache_buffer *b )
+{
+	if(b->loading) settle();
+	if(b->prefetched) {
+		b->prefetched = 0;
+		nprefetchpending--;
+		nprefetchhits++;
+	}
+	b->referenced = 1;
+}
+
+/* grava todos os buffers sujos, com todos os pedidos em voo ao mesmo tempo */
+static void flush_dirty()
+{
+	int i, n = 0;
+
+	for(i=0;i<nused;i++) {
+		if(buffers[i].dirty) flushlist[n++] = i;
+	}
+	if(n==0) return;
+
+	qsort(flushlist,n,sizeof(int),compare_blocknum);
+
+	for(i=0;i<n;i++) {
+		disk_submit_write(buffers[flushlist[i]].blocknum,buffers[flushlist[i]].data);
+	}
+	disk_wait();
+
+	for(i=0;i<n;i++) {
+		buffers[flushlist[i]].dirty = 0;
+	}
+	nwritebacks += n;
+}
+
+/* escolhe um buffer para o bloco, substituindo outro se o cache estiver cheio; 0 se nao houver */
+static struct cache_buffer * victim()
+{
+	struct cache_buffer *b;
+	int tries;
+
+	if(nused<nbuffers) return &buffers[nused++];
+
+	// duas voltas: a primeira pode so limpar os bits de referencia
+	for(tries=0;tries<2*nbuffers;tries++) {
+		b = &buffers[hand];
+		hand = (hand+1)%nbuffers;
+		if(b->pinned || b->reading) continue;
+		if(b->referenced) {
+			b->referenced = 0;
+		} else {
+			if(b->loading) settle();
+			if(b->dirty) flush_dirty();
+			if(b->prefetched) {
+				nprefetchwasted++;
+				nprefetchpending--;
+			}
+			if(b->blocknum>=0) lookup[b->blocknum] = -1;
+			return b;
+		}
+	}
+
+	return 0;
+}
+
+static struct cache_buffer * lookup_buffer( int blocknum )
+{
+	if(blocknum<0 || blocknum>=disk_size()) return 0;
+	if(lookup[blocknum]<0) return 0;
+	return &buffers[lookup[blocknum]];
+}
+
+static struct cache_buffer * insert_buffer( int blocknum )
+{
+	struct cache_buffer *b = victim();
+
+	if(!b) return 0;
+
+	b->blocknum = blocknum;
+	b->dirty = 0;
+	b->referenced = 1;
+	b->loading = 0;
+	b->prefetched = 0;
+	b->pinned = 0;
+	b->reading = 0;
+	lookup[blocknum] = b - buffers;
+
+	return b;
+}
+
+/*
+Blocos que faltavam no cache, lidos do disco sem cache_lock. Cada um vai
+direto para o buffer reservado para ele, ou, sem buffer, para onde o chamador
+quer os dados.
+*/
+struct cache_misses {
+	int count;
+	int capacity;
+	int *blocknums;
+	char **data;
+	struct cache_buffer **owners;
+	int *index;		// posicao do bloco no pedido original
+};
+
+static void misses_init( struct cache_misses *m, int capacity )
+{
+	m->count = 0;
+	m->capacity = capacity;
+	m->blocknums = 0;
+	m->data = 0;
+	m->owners = 0;
+	m->index = 0;
+}
+
+static void misses_add( struct cache_misses *m, int blocknum, struct cache_buffer *b, char *data, int index )
+{
+	// os vetores so sao alocados na primeira falta
+	if(!m->blocknums) {
+		m->blocknums = (int *) malloc(m->capacity*sizeof(int));
+		m->data = (char **) malloc(m->capacity*sizeof(char *));
+		m->owners = (struct cache_buffer **) malloc(m->capacity*sizeof(struct cache_buffer *));
+		m->index = (int *) malloc(m->capacity*sizeof(int));
+		if(!m->blocknums || !m->data || !m->owners || !m->index) {
+			printf("ERROR: out of memory in the block cache\n");
+			abort();
+		}
+	}
+	if(b) b->reading = 1;
+	m->blocknums[m->count] = blocknum;
+	m->data[m->count] = b ? b->data : data;
+	m->owners[m->count] = b;
+	m->index[m->count] = index;
+	m->count++;
+}
+
+/*
+Le os blocos (chamada sem cache_lock) e libera os buffers para os outros; copy
+recebe os dados, se nao for 0. Os pedidos vao todos juntos pelo motor
+assincrono, que tem o proprio lock, para ficarem varios em voo ao mesmo tempo.
+*/
+static void misses_read( struct cache_misses *m, char *copy )
+{
+	int i;
+
+	if(m->count==0) return;
+
+	for(i=0;i<m->count;i++) {
+		disk_submit_read(m->blocknums[i],m->data[i]);
+	}
+	disk_wait();
+
+	pthread_mutex_lock(&cache_lock);
+	for(i=0;i<m->count;i++) {
+		if(!m->owners[i]) continue;
+		m->owners[i]->reading = 0;
+		if(copy) memcpy(&copy[m->index[i]*DISK_BLOCK_SIZE],m->owners[i]->data,DISK_BLOCK_SIZE);
+	}
+	pthread_cond_broadcast(&cache_done);
+	pthread_mutex_unlock(&cache_lock);
+
+	free(m->blocknums);
+	free(m->data);
+	free(m->owners);
+	free(m->index);
+}
+
+/* buffers do cache; 0 com o cache desligado */
+int cache_buffers()
+{
+	return nbuffers;
+}
+
+void cache_read( int blocknum, char *data )
+{
+	cache_read_blocks(&blocknum,1,data);
+}
+
+void cache_write( int blocknum, const char *data )
+{
+	struct cache_buffer *b;
+
+	if(nbuffers==0) {
+		disk_write(blocknum,data);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+
+	// uma leitura em andamento sobrescreveria o que for escrito agora
+	while((b = lookup_buffer(blocknum)) && b->reading) {
+		pthread_cond_wait(&cache_done,&cache_lock);
+	}
+
+	if(b) {
+		nhits++;
+		if(b->loading) settle();
+	} else {
+		nmisses++;
+		if(blocknum>=0 && blocknum<disk_size()) b = insert_buffer(blocknum);	// bloco inteiro, nao precisa ler antes
+		if(!b) {
+			pthread_mutex_unlock(&cache_lock);
+			disk_write(blocknum,data);	// sem buffer livre, ou deixa o disco reportar o erro
+			return;
+		}
+	}
+
+	b->referenced = 1;
+	if(b->prefetched) nprefetchpending--;
+	b->prefetched = 0;
+	b->dirty = 1;
+	memcpy(b->data,data,DISK_BLOCK_SIZE);
+
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+Le count blocos para data, que deve ter count*DISK_BLOCK_SIZE bytes. Os
+blocos que nao estao no cache sao pedidos ao disco todos juntos.
+*/
+void cache_read_blocks( const int *blocknums, int count, char *data )
+{
+	struct cache_buffer *b;
+	struct cache_misses misses;
+	int i;
+
+	if(count<=0) return;
+
+	misses_init(&misses,count);
+
+	if(nbuffers==0) {
+		for(i=0;i<count;i++) misses_add(&misses,blocknums[i],0,&data[i*DISK_BLOCK_SIZE],i);
+		misses_read(&misses,0);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	for(i=0;i<count;i++) {
+		b = lookup_buffer(blocknums[i]);
+		if(b && !b->reading) {
+			nhits++;
+			touch(b);
+			memcpy(&data[i*DISK_BLOCK_SIZE],b->data,DISK_BLOCK_SIZE);
+			continue;
+		}
+		// sendo lido por outra thread: le de novo, direto para data
+		nmisses++;
+		if(!b && blocknums[i]>=0 && blocknums[i]<disk_size()) b = insert_buffer(blocknums[i]);
+		else b = 0;
+		misses_add(&misses,blocknums[i],b,&data[i*DISK_BLOCK_SIZE],i);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	misses_read(&misses,data);
+}
+
+/*
+Leitura antecipada: pede ao disco os blocos que nao estao no cache, cada um
+direto no seu buffer, e volta sem esperar. No maximo um quarto do cache fica
+com blocos antecipados ainda nao lidos, somando todas as threads, para a
+leitura antecipada nao expulsar o que ainda vai ser lido; retorna quantos
+blocos do inicio da lista foram aceitos.
+*/
+int cache_prefetch( const int *blocknums, int count )
+{
+	struct cache_buffer *b;
+	int i, n = 0;
+
+	if(nbuffers==0) return 0;
+
+	pthread_mutex_lock(&cache_lock);
+	for(i=0;i<count;i++) {
+		if(blocknums[i]<0 || blocknums[i]>=disk_size()) continue;
+		if(lookup_buffer(blocknums[i])) continue;
+		if(nprefetchpending>=nbuffers/4) break;
+		b = insert_buffer(blocknums[i]);
+		if(!b) break;
+		b->loading = 1;
+		b->prefetched = 1;
+		nprefetchpending++;
+		disk_submit_read(blocknums[i],b->data);
+		nloading++;
+		n++;
+	}
+	if(n) {
+		disk_start();
+		nprefetches++;
+		nprefetched += n;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return i;
+}
+
+/*
+Fixa os count blocos no cache e poe em data[i] o ponteiro para o conteudo de
+cada um. Os que faltam sao lidos do disco juntos, direto nos buffers. Para no
+limite de buffers fixados; retorna quantos blocos do inicio foram fixados.
+Sem cache, os ponteiros sao os blocos mapeados do disco, se o backend guarda
+os blocos na memoria.
+*/
+int cache_pin_blocks( const int *blocknums, int count, const char **data )
+{
+	struct cache_buffer *b;
+	struct cache_misses misses;
+	int i;
+
+	if(nbuffers==0) {
+		for(i=0;i<count;i++) {
+			if(blocknums[i]<0 || blocknums[i]>=disk_size()) break;
+			data[i] = disk_map(blocknums[i]);
+			if(!data[i]) break;
+		}
+		return i;
+	}
+
+	if(count<=0) return 0;
+
+	misses_init(&misses,count);
+
+	pthread_mutex_lock(&cache_lock);
+	for(i=0;i<count;i++) {
+		if(blocknums[i]<0 || blocknums[i]>=disk_size()) break;
+		b = lookup_buffer(blocknums[i]);
+		if(b) {
+			if(b->reading) break;
+			if(!b->pinned && npinned>=nbuffers/2) break;
+			nhits++;
+			touch(b);
+		} else {
+			if(npinned>=nbuffers/2) break;
+			b = insert_buffer(blocknums[i]);
+			if(!b) break;
+			nmisses++;
+			misses_add(&misses,blocknums[i],b,0,i);
+		}
+		if(b->pinned++==0) npinned++;
+		data[i] = b->data;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	misses_read(&misses,0);
+
+	return i;
+}
+
+/* solta um bloco fixado, pelo ponteiro devolvido por cache_pin_blocks */
+void cache_unpin( const char *data )
+{
+	struct cache_buffer *b;
+
+	if(nbuffers==0) return;
+
+	pthread_mutex_lock(&cache_lock);
+	b = &buffers[(data - (const char *)buffers) / sizeof(struct cache_buffer)];
+	if(b->pinned>0 && --b->pinned==0) npinned--;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_write_blocks( const int *blocknums, int count, const char *data )
+{
+	const char **pointers;
+	int i;
+
+	if(count<=0) return;
+
+	if(nbuffers==0) {
+		pointers = (const char **) malloc(count*sizeof(const char *));
+		if(!pointers) {
+			printf("ERROR: out of memory in the block cache\n");
+			abort();
+		}
+		for(i=0;i<count;i++) pointers[i] = &data[i*DISK_BLOCK_SIZE];
+		disk_writev(blocknums,pointers,count);
+		free(pointers);
+		return;
+	}
+
+	for(i=0;i<count;i++) {
+		cache_write(blocknums[i],&data[i*DISK_BLOCK_SIZE]);
+	}
+}
+
+/* esquece os blocos do intervalo, sem gravar os que estiverem sujos */
+void cache_discard( int blocknum, int count )
+{
+	struct cache_buffer *b;
+	int i;
+
+	if(nbuffers==0) return;
+
+	pthread_mutex_lock(&cache_lock);
+	for(i=0;i<nused;i++) {
+		b = &buffers[i];
+		if(b->blocknum>=blocknum && b->blocknum<blocknum+count) {
+			if(b->loading) settle();
+			if(b->prefetched) {
+				nprefetchwasted++;
+				nprefetchpending--;
+			}
+			lookup[b->blocknum] = -1;
+			b->blocknum = -1;	// buffer livre, vira vitima na proxima volta
+			b->dirty = 0;
+			b->referenced = 0;
+			b->prefetched = 0;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_sync()
+{
+	if(nbuffers==0) return;
+	pthread_mutex_lock(&cache_lock);
+	settle();
+	flush_dirty();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_print_stats( FILE *file )
+{
+	pthread_mutex_lock(&cache_lock);
+	fprintf(file,"cache statistics:\n");
+	fprintf(file,"\t%d hits, %d misses, %d writebacks\n",nhits,nmisses,nwritebacks);
+	fprintf(file,"\treadahead: %d requests, %d blocks",nprefetches,nprefetched);
+	if(nprefetches) fprintf(file," (%.1f per request)",(double)nprefetched/nprefetches);
+	fprintf(file,"\n\treadahead: %d blocks used, %d wasted\n",nprefetchhits,nprefetchwasted);
+	pthread_mutex_unlock(&cache_lock);
+}
+void cache_close()
+{
+	if(!buffers) return;
+
+	cache_sync();
+
+	printf("%d cache hits\n",nhits);
+	printf("%d cache misses\n",nmisses);
+	printf("%d cache writebacks\n",nwritebacks);
+	if(nprefetched) printf("%d readahead blocks, %d used\n",nprefetched,nprefetchhits);
+
+	free(buffers);
+	free(lookup);
+	free(flushlist);
+	buffers = 0;
+	lookup = 0;
+	flushlist = 0;
+	nbuffers = 0;
+	nused = 0;
+}
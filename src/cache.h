@@ -0,0 +1,22 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+
+#define CACHE_DEFAULT_BUFFERS 64
+
+int  cache_init( int nbuffers );
+int  cache_buffers();
+void cache_read( int blocknum, char *data );
+void cache_write( int blocknum, const char *data );
+void cache_read_blocks( const int *blocknums, int count, char *data );
+void cache_write_blocks( const int *blocknums, int count, const char *data );
+int  cache_prefetch( const int *blocknums, int count );
+int  cache_pin_blocks( const int *blocknums, int count, const char **data );
+void cache_unpin( const char *data );
+void cache_discard( int blocknum, int count );
+void cache_sync();
+void cache_print_stats( FILE *file );
+void cache_close();
+
+#endif
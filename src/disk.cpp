@@ -4,27 +4,74 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 
 #include "disk.h"
+#include "disk_backend.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
+static disk_backend *backend=0;
 static int nblocks=0;
 static int nreads=0;
 static int nwrites=0;
+static int ndiscards=0;
+static int ring_file=-1;	// descritor usado pelos pedidos do io_uring
 
-int disk_init( const char *filename, int n )
+/*
+Varias threads podem usar o disco ao mesmo tempo. As transferencias sincronas
+(disk_read, disk_readv...) vao direto ao backend, que usa preadv/pwritev ou
+memcpy em blocos diferentes, sem lock; so os contadores, as estatisticas e o
+relogio do modelo ficam sob stats_lock. O motor assincrono tem uma fila so,
+protegida por engine_lock do disk_submit_* ate o fim do disk_wait().
+*/
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int uring_init( int fd );
+static void uring_close();
+static int stats_init( int n );
+static void stats_close();
+
+int disk_init( const char *filename, int n, int mode )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	switch(mode) {
+		case DISK_MODE_FILE:
+			backend = disk_file_backend(filename,n);
+			break;
+		case DISK_MODE_MMAP:
+			backend = disk_mmap_backend(filename,n);
+			break;
+		case DISK_MODE_RAM:
+			backend = disk_ram_backend(filename,n);
+			break;
+		default:
+			errno = EINVAL;
+			backend = 0;
+			break;
+	}
+	if(!backend) return 0;
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	if(!stats_init(n)) {
+		stats_close();
+		delete backend;
+		backend = 0;
+		errno = ENOMEM;
+		return 0;
+	}
+
+	if(backend->fd()>=0) uring_init(backend->fd());
 
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	ndiscards = 0;
 
 	return 1;
 }
@@ -52,41 +99,713 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
+/*
+Devolve um ponteiro direto para o bloco, ou 0 se o backend nao guardar os
+blocos na memoria (modos DISK_MODE_MMAP e DISK_MODE_RAM guardam). Acessos
+feitos pelo ponteiro nao entram na contagem de leituras e escritas.
+*/
+char *disk_map( int blocknum )
+{
+	sanity_check(blocknum,backend);
+	return backend->map(blocknum);
+}
+
+/*
+Modelo de tempo do dispositivo (opcional).
+
+Cada pedido ao backend (uma sequencia de blocos consecutivos) custa um
+overhead fixo, mais seek e meia volta de rotacao quando nao continua de onde
+o pedido anterior parou, mais o tempo de transferencia de cada bloco. O seek
+cresce com a raiz da distancia, como num braco de disco real.
+
+Pedidos enviados juntos por disk_wait() sao distribuidos entre queue_depth
+canais, como as filas de um SSD; o lote termina quando o canal mais ocupado
+termina. O relogio virtual so anda com o tempo simulado, nunca com o real.
+*/
+
+struct disk_model {
+	double overhead;	// us por pedido
+	double seek_min;	// us para andar um bloco
+	double seek_max;	// us para atravessar o disco todo
+	double rotation;	// us de uma volta completa
+	double transfer;	// us por bloco transferido
+	int queue_depth;
+};
+
+#define DISK_MODEL_CHANNELS 64
+
+static const struct disk_model models[] = {
+	{ 0, 0, 0, 0, 0, 1 },				// DISK_MODEL_NONE
+	{ 50, 500, 15000, 8333, 27, 1 },	// DISK_MODEL_HDD, 7200rpm e 150MB/s
+	{ 80, 0, 0, 0, 2, 32 },				// DISK_MODEL_SSD, 2GB/s
+};
+
+static int model=DISK_MODEL_NONE;
+static double clock_us=0;			// relogio virtual
+static int model_head=0;			// bloco seguinte ao ultimo pedido
+static thread_local int inbatch=0;		// cada thread monta o seu lote
+static thread_local double channel[DISK_MODEL_CHANNELS];
+static thread_local int nchannels=0;
+
+void disk_set_model( int m )
+{
+	if(m<DISK_MODEL_NONE || m>DISK_MODEL_SSD) m = DISK_MODEL_NONE;
+	pthread_mutex_lock(&stats_lock);
+	model = m;
+	clock_us = 0;
+	model_head = 0;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+double disk_elapsed()
+{
+	double elapsed;
+
+	pthread_mutex_lock(&stats_lock);
+	elapsed = clock_us/1000.0;
+	pthread_mutex_unlock(&stats_lock);
+	return elapsed;
+}
+
+/* chamada com stats_lock */
+static void model_request( int blocknum, int n )
+{
+	const struct disk_model *m = &models[model];
+	double cost;
+	int distance, i, c;
+
+	if(model==DISK_MODEL_NONE) return;
+
+	cost = m->overhead + n*m->transfer;
+	distance = abs(blocknum-model_head);
+	if(distance>0 && m->seek_max>0) {
+		cost += m->seek_min + (m->seek_max-m->seek_min)*sqrt((double)distance/nblocks) + m->rotation/2;
+	}
+	model_head = blocknum+n;
+
+	if(!inbatch) {
+		clock_us += cost;
+		return;
+	}
+
+	// o pedido vai para o canal que fica livre primeiro
+	c = 0;
+	for(i=1;i<nchannels;i++) {
+		if(channel[i]<channel[c]) c = i;
+	}
+	channel[c] += cost;
+}
+
+static void model_batch_begin()
+{
+	int i;
+
+	inbatch = 1;
+	nchannels = models[model].queue_depth;
+	if(nchannels>DISK_MODEL_CHANNELS) nchannels = DISK_MODEL_CHANNELS;
+	for(i=0;i<nchannels;i++) channel[i] = 0;
+}
+
+static void model_batch_end()
+{
+	double longest = 0;
+	int i;
+
+	for(i=0;i<nchannels;i++) {
+		if(channel[i]>longest) longest = channel[i];
+	}
+	pthread_mutex_lock(&stats_lock);
+	clock_us += longest;
+	pthread_mutex_unlock(&stats_lock);
+	inbatch = 0;
+}
+
+/*
+Estatisticas por bloco e por pedido.
+
+Cada bloco tem contadores de leitura e escrita e uma classe (superbloco,
+tabela de inodos, bloco indireto ou dados) informada pelo fs com
+disk_classify(). Um pedido eh sequencial se comeca logo depois de onde o
+anterior terminou. A latencia real de cada pedido entra num histograma em
+potencias de 2 de microssegundos.
+*/
+
+#define DISK_LATENCY_BUCKETS 24
+
+static const char *class_names[DISK_CLASSES] = { "data", "superblock", "inode table", "indirect", "bitmap" };
+
+static int *blockreads=0;
+static int *blockwrites=0;
+static unsigned char *blockclass=0;
+static int classreads[DISK_CLASSES];
+static int classwrites[DISK_CLASSES];
+static int nrequests=0;
+static int nsequential=0;
+static int lastblock=-1;
+static int latency[DISK_LATENCY_BUCKETS];
+
+static int stats_init( int n )
+{
+	blockreads = (int *) calloc(n,sizeof(int));
+	blockwrites = (int *) calloc(n,sizeof(int));
+	blockclass = (unsigned char *) calloc(n,1);
+	if(!blockreads || !blockwrites || !blockclass) return 0;
+
+	memset(classreads,0,sizeof(classreads));
+	memset(classwrites,0,sizeof(classwrites));
+	memset(latency,0,sizeof(latency));
+	nrequests = 0;
+	nsequential = 0;
+	lastblock = -1;
+
+	return 1;
+}
+
+static void stats_close()
+{
+	free(blockreads);
+	free(blockwrites);
+	free(blockclass);
+	blockreads = 0;
+	blockwrites = 0;
+	blockclass = 0;
+}
+
+static long long now_ns()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return (long long)t.tv_sec*1000000000LL + t.tv_nsec;
+}
+
+/* chamada com stats_lock, como stats_latency */
+static void stats_request( int blocknum, int n, int write )
+{
+	int i;
+
+	nrequests++;
+	if(blocknum==lastblock) nsequential++;
+	lastblock = blocknum+n;
+
+	for(i=blocknum;i<blocknum+n;i++) {
+		if(write) {
+			blockwrites[i]++;
+			classwrites[blockclass[i]]++;
+		} else {
+			blockreads[i]++;
+			classreads[blockclass[i]]++;
+		}
+	}
+}
+
+static void stats_latency( long long ns )
+{
+	long long us = ns/1000;
+	int b = 0;
+
+	while(us>1 && b<DISK_LATENCY_BUCKETS-1) {
+		us >>= 1;
+		b++;
+	}
+	latency[b]++;
+}
+
+void disk_classify( int blocknum, int cls )
+{
+	if(!blockclass || blocknum<0 || blocknum>=nblocks) return;
+	if(cls<0 || cls>=DISK_CLASSES) cls = DISK_CLASS_DATA;
+	blockclass[blocknum] = cls;
+}
+
+int disk_class( int blocknum )
+{
+	if(!blockclass || blocknum<0 || blocknum>=nblocks) return DISK_CLASS_DATA;
+	return blockclass[blocknum];
+}
+
+/*
+Mostra as estatisticas em file. Com verbose, lista tambem os contadores de
+todos os blocos que ja foram acessados, em vez de so os mais usados.
+*/
+void disk_print_stats( FILE *file, int verbose )
+{
+	int hottest[10];
+	int nhottest = 0;
+	int i, j, c;
+
+	if(!backend) return;
+
+	pthread_mutex_lock(&stats_lock);
+	fprintf(file,"block I/O statistics:\n");
+	fprintf(file,"\t%d block reads, %d block writes in %d requests\n",nreads,nwrites,nrequests);
+	if(ndiscards) fprintf(file,"\t%d blocks discarded\n",ndiscards);
+	fprintf(file,"\t%d sequential requests, %d random (%.1f%% sequential)\n",nsequential,nrequests-nsequential,nrequests ? 100.0*nsequential/nrequests : 0.0);
+	if(model!=DISK_MODEL_NONE) fprintf(file,"\t%.3f ms simulated device time\n",clock_us/1000.0);
+
+	fprintf(file,"\tby class:\n");
+	for(c=0;c<DISK_CLASSES;c++) {
+		fprintf(file,"\t\t%-12s %d reads, %d writes\n",class_names[c],classreads[c],classwrites[c]);
+	}
+
+	fprintf(file,"\trequest latency:\n");
+	for(i=0;i<DISK_LATENCY_BUCKETS;i++) {
+		if(latency[i]==0) continue;
+		if(i==0) fprintf(file,"\t\t%10s us: %d\n","< 2",latency[i]);
+		else fprintf(file,"\t\t%4d-%5d us: %d\n",1<<i,(1<<(i+1))-1,latency[i]);
+	}
+
+	if(verbose) {
+		fprintf(file,"\tblocks (block reads writes class):\n");
+		for(i=0;i<nblocks;i++) {
+			if(blockreads[i] || blockwrites[i]) {
+				fprintf(file,"\t\t%d %d %d %s\n",i,blockreads[i],blockwrites[i],class_names[blockclass[i]]);
+			}
+		}
+		pthread_mutex_unlock(&stats_lock);
+		return;
+	}
+
+	// os 10 blocos mais acessados, por insercao ordenada
+	for(i=0;i<nblocks;i++) {
+		int accesses = blockreads[i]+blockwrites[i];
+		if(accesses==0) continue;
+		for(j=nhottest;j>0 && blockreads[hottest[j-1]]+blockwrites[hottest[j-1]]<accesses;j--) {
+			if(j<10) hottest[j] = hottest[j-1];
+		}
+		if(j<10) {
+			hottest[j] = i;
+			if(nhottest<10) nhottest++;
+		}
+	}
+	fprintf(file,"\thottest blocks:\n");
+	for(i=0;i<nhottest;i++) {
+		fprintf(file,"\t\tblock %d: %d reads, %d writes (%s)\n",hottest[i],blockreads[hottest[i]],blockwrites[hottest[i]],class_names[blockclass[hottest[i]]]);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void transfer_run( int blocknum, struct iovec *iov, int n, int write );
+
 void disk_read( int blocknum, char *data )
 {
+	struct iovec iov = { data, DISK_BLOCK_SIZE };
+
 	sanity_check(blocknum,data);
+	transfer_run(blocknum,&iov,1,0);
+}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+void disk_write( int blocknum, const char *data )
+{
+	struct iovec iov = { (char *)data, DISK_BLOCK_SIZE };
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
-	} else {
+	sanity_check(blocknum,data);
+	transfer_run(blocknum,&iov,1,1);
+}
+
+/*
+Transfere uma sequencia de blocos de uma vez. Blocos com numeros consecutivos
+sao agrupados numa unica chamada ao backend (preadv/pwritev no modo
+DISK_MODE_FILE), com ate DISK_RUN_MAX blocos por chamada.
+*/
+
+#define DISK_RUN_MAX 64
+
+static int run_length( const int *blocknums, int count )
+{
+	int n = 1;
+	while(n<count && n<DISK_RUN_MAX && blocknums[n]==blocknums[0]+n) n++;
+	return n;
+}
+
+static void transfer_run( int blocknum, struct iovec *iov, int n, int write )
+{
+	long long start = now_ns();
+
+	if(!backend->transfer(blocknum,iov,n,write)) {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
+
+	pthread_mutex_lock(&stats_lock);
+	stats_latency(now_ns()-start);
+	stats_request(blocknum,n,write);
+	model_request(blocknum,n);
+	if(write) nwrites += n;
+	else nreads += n;
+	pthread_mutex_unlock(&stats_lock);
 }
 
-void disk_write( int blocknum, const char *data )
+static void transfer_blocks( const int *blocknums, char * const *data, int count, int write )
 {
-	sanity_check(blocknum,data);
+	struct iovec iov[DISK_RUN_MAX];
+	int i, n;
+
+	for(i=0;i<count;i++) sanity_check(blocknums[i],data[i]);
+
+	// as sequencias de uma chamada contam no modelo como pedidas juntas
+	model_batch_begin();
+	while(count>0) {
+		n = run_length(blocknums,count);
+		for(i=0;i<n;i++) {
+			iov[i].iov_base = data[i];
+			iov[i].iov_len = DISK_BLOCK_SIZE;
+		}
+		transfer_run(blocknums[0],iov,n,write);
+		blocknums += n;
+		data += n;
+		count -= n;
+	}
+	model_batch_end();
+}
+
+void disk_readv( const int *blocknums, char * const *data, int count )
+{
+	transfer_blocks(blocknums,data,count,0);
+}
+
+void disk_writev( const int *blocknums, const char * const *data, int count )
+{
+	transfer_blocks(blocknums,(char * const *)data,count,1);
+}
+
+/*
+Faz count blocos a partir de blocknum passarem a ser lidos como zero. O
+backend tenta descartar o espaco (buraco no arquivo, paginas liberadas); se
+nao conseguir, os blocos sao zerados com escritas normais.
+*/
+void disk_discard( int blocknum, int count )
+{
+	static char zeros[DISK_RUN_MAX][DISK_BLOCK_SIZE];
+	struct iovec iov[DISK_RUN_MAX];
+	int i, n;
+
+	if(count<=0) return;
+	sanity_check(blocknum,backend);
+	sanity_check(blocknum+count-1,backend);
+
+	disk_wait();
+
+	if(backend->discard(blocknum,count)) {
+		pthread_mutex_lock(&stats_lock);
+		ndiscards += count;
+		pthread_mutex_unlock(&stats_lock);
+		return;
+	}
+
+	for(i=0;i<DISK_RUN_MAX;i++) {
+		iov[i].iov_base = zeros[i];
+		iov[i].iov_len = DISK_BLOCK_SIZE;
+	}
+	while(count>0) {
+		n = count<DISK_RUN_MAX ? count : DISK_RUN_MAX;
+		transfer_run(blocknum,iov,n,1);
+		blocknum += n;
+		count -= n;
+	}
+}
+
+/*
+Motor assincrono de E/S usando io_uring.
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+disk_submit_read/disk_submit_write apenas guardam o pedido; os buffers nao
+podem ser usados ate disk_wait() retornar. Em disk_wait() os pedidos sao
+ordenados por bloco, os de blocos consecutivos viram um unico READV/WRITEV,
+e ate DISK_QUEUE_DEPTH deles ficam em voo ao mesmo tempo.
+disk_start() faz o mesmo agrupamento e submissao, mas volta sem esperar; os
+buffers continuam intocaveis ate o proximo disk_wait().
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+Se o kernel nao tiver io_uring, ou o backend nao for um arquivo, os pedidos
+agrupados sao atendidos de forma sincrona pelo backend.
+*/
+
+#define DISK_QUEUE_DEPTH 64
+#define DISK_PENDING_MAX 1024
+
+struct disk_pending {
+	int blocknum;
+	int write;
+	char *data;
+};
+
+struct disk_request {
+	struct iovec iov[DISK_RUN_MAX];
+	int nblocks;
+	int write;
+	long long start;
+};
+
+static int ringfd=-1;
+static unsigned *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static void *sq_ring=0, *cq_ring=0;
+static size_t sq_ring_size, cq_ring_size, sqes_size;
+static unsigned nqueued=0;		// na fila, ainda nao submetidos ao kernel
+static unsigned ninflight=0;	// submetidos, esperando conclusao
+static struct disk_request requests[DISK_QUEUE_DEPTH];
+static int freeslots[DISK_QUEUE_DEPTH];
+static int nfreeslots=0;
+static struct disk_pending pending[DISK_PENDING_MAX];
+static int npending=0;
+
+static int uring_init( int fd )
+{
+	struct io_uring_params p;
+	int i;
+
+	memset(&p,0,sizeof(p));
+	ringfd = syscall(__NR_io_uring_setup,DISK_QUEUE_DEPTH,&p);
+	if(ringfd<0) return 0;
+
+	sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(cq_ring_size>sq_ring_size) sq_ring_size = cq_ring_size;
+		cq_ring_size = sq_ring_size;
+	}
+	sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+
+	sq_ring = mmap(0,sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQ_RING);
+	if(sq_ring==MAP_FAILED) {
+		sq_ring = 0;
+		uring_close();
+		return 0;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ring = sq_ring;
 	} else {
+		cq_ring = mmap(0,cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_CQ_RING);
+		if(cq_ring==MAP_FAILED) {
+			cq_ring = 0;
+			uring_close();
+			return 0;
+		}
+	}
+	sqes = (struct io_uring_sqe *) mmap(0,sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQES);
+	if(sqes==MAP_FAILED) {
+		sqes = 0;
+		uring_close();
+		return 0;
+	}
+
+	sq_tail  = (unsigned *)((char *)sq_ring + p.sq_off.tail);
+	sq_mask  = (unsigned *)((char *)sq_ring + p.sq_off.ring_mask);
+	sq_array = (unsigned *)((char *)sq_ring + p.sq_off.array);
+	cq_head  = (unsigned *)((char *)cq_ring + p.cq_off.head);
+	cq_tail  = (unsigned *)((char *)cq_ring + p.cq_off.tail);
+	cq_mask  = (unsigned *)((char *)cq_ring + p.cq_off.ring_mask);
+	cqes     = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+
+	nqueued = 0;
+	ninflight = 0;
+	nfreeslots = 0;
+	for(i=DISK_QUEUE_DEPTH-1;i>=0;i--) freeslots[nfreeslots++] = i;
+
+	ring_file = fd;
+	return 1;
+}
+
+static void uring_close()
+{
+	if(sqes) munmap(sqes,sqes_size);
+	if(cq_ring && cq_ring!=sq_ring) munmap(cq_ring,cq_ring_size);
+	if(sq_ring) munmap(sq_ring,sq_ring_size);
+	if(ringfd>=0) close(ringfd);
+	sqes = 0;
+	cq_ring = 0;
+	sq_ring = 0;
+	ringfd = -1;
+}
+
+static int uring_enter( unsigned to_submit, unsigned min_complete )
+{
+	int result;
+
+	do {
+		result = syscall(__NR_io_uring_enter,ringfd,to_submit,min_complete,min_complete ? IORING_ENTER_GETEVENTS : 0,0,0);
+	} while(result<0 && errno==EINTR);
+
+	if(result<0) {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
+
+	return result;
+}
+
+static void uring_reap()
+{
+	unsigned head = *cq_head;
+	struct io_uring_cqe *cqe;
+	struct disk_request *r;
+
+	while(head != __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE)) {
+		cqe = &cqes[head & *cq_mask];
+		r = &requests[cqe->user_data];
+
+		if(cqe->res != r->nblocks*DISK_BLOCK_SIZE) {
+			printf("ERROR: couldn't access simulated disk: %s\n",cqe->res<0 ? strerror(-cqe->res) : "short transfer");
+			abort();
+		}
+		pthread_mutex_lock(&stats_lock);
+		if(r->write) nwrites += r->nblocks;
+		else nreads += r->nblocks;
+		stats_latency(now_ns()-r->start);
+		pthread_mutex_unlock(&stats_lock);
+
+		freeslots[nfreeslots++] = cqe->user_data;
+		ninflight--;
+		head++;
+	}
+	__atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+}
+
+/* submete o que estiver na fila e espera ao menos min_complete conclusoes */
+static void uring_flush( unsigned min_complete )
+{
+	int submitted = uring_enter(nqueued,min_complete);
+	nqueued -= submitted;
+	ninflight += submitted;
+	uring_reap();
+}
+
+/* coloca uma sequencia de blocos consecutivos na fila de submissao */
+static void uring_queue( const struct disk_pending *p, int n )
+{
+	struct disk_request *r;
+	struct io_uring_sqe *sqe;
+	unsigned tail, index;
+	int slot, i;
+
+	if(nfreeslots==0) uring_flush(1);
+
+	slot = freeslots[--nfreeslots];
+	r = &requests[slot];
+	for(i=0;i<n;i++) {
+		r->iov[i].iov_base = p[i].data;
+		r->iov[i].iov_len = DISK_BLOCK_SIZE;
+	}
+	r->nblocks = n;
+	r->write = p[0].write;
+	r->start = now_ns();
+	pthread_mutex_lock(&stats_lock);
+	stats_request(p[0].blocknum,n,r->write);
+	model_request(p[0].blocknum,n);
+	pthread_mutex_unlock(&stats_lock);
+
+	tail = *sq_tail;
+	index = tail & *sq_mask;
+	sqe = &sqes[index];
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = ring_file;
+	sqe->off = (off_t)p[0].blocknum*DISK_BLOCK_SIZE;
+	sqe->addr = (unsigned long) r->iov;
+	sqe->len = n;
+	sqe->user_data = slot;
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail,tail+1,__ATOMIC_RELEASE);
+
+	nqueued++;
+}
+
+static int compare_pending( const void *a, const void *b )
+{
+	const struct disk_pending *x = (const struct disk_pending *) a;
+	const struct disk_pending *y = (const struct disk_pending *) b;
+
+	if(x->blocknum != y->blocknum) return x->blocknum - y->blocknum;
+	if(x->write != y->write) return x->write - y->write;
+	return x < y ? -1 : x > y;
+}
+
+/* agrupa os pedidos guardados em sequencias e manda todas para o disco */
+static void dispatch_pending()
+{
+	struct iovec iov[DISK_RUN_MAX];
+	int i, j, n;
+
+	if(npending==0) return;
+
+	qsort(pending,npending,sizeof(struct disk_pending),compare_pending);
+	model_batch_begin();
+
+	for(i=0;i<npending;i+=n) {
+		n = 1;
+		while(i+n<npending && n<DISK_RUN_MAX && pending[i+n].write==pending[i].write && pending[i+n].blocknum==pending[i].blocknum+n) n++;
+
+		if(ringfd>=0) {
+			uring_queue(&pending[i],n);
+		} else {
+			for(j=0;j<n;j++) {
+				iov[j].iov_base = pending[i+j].data;
+				iov[j].iov_len = DISK_BLOCK_SIZE;
+			}
+			transfer_run(pending[i].blocknum,iov,n,pending[i].write);
+		}
+	}
+	model_batch_end();
+	npending = 0;
+}
+
+static void submit( int blocknum, char *data, int write )
+{
+	sanity_check(blocknum,data);
+
+	if(npending==DISK_PENDING_MAX) dispatch_pending();
+
+	pending[npending].blocknum = blocknum;
+	pending[npending].write = write;
+	pending[npending].data = data;
+	npending++;
+}
+
+void disk_submit_read( int blocknum, char *data )
+{
+	pthread_mutex_lock(&engine_lock);
+	submit(blocknum,data,0);
+	pthread_mutex_unlock(&engine_lock);
+}
+
+void disk_submit_write( int blocknum, const char *data )
+{
+	pthread_mutex_lock(&engine_lock);
+	submit(blocknum,(char *)data,1);
+	pthread_mutex_unlock(&engine_lock);
+}
+
+/* manda os pedidos guardados para o disco, sem esperar que terminem */
+void disk_start()
+{
+	pthread_mutex_lock(&engine_lock);
+	dispatch_pending();
+	if(ringfd>=0 && nqueued) uring_flush(0);
+	pthread_mutex_unlock(&engine_lock);
+}
+
+/* espera todos os pedidos do motor, inclusive os enviados por outras threads */
+void disk_wait()
+{
+	pthread_mutex_lock(&engine_lock);
+	dispatch_pending();
+	while(ringfd>=0 && (nqueued || ninflight)) {
+		uring_flush(nqueued+ninflight);
+	}
+	pthread_mutex_unlock(&engine_lock);
 }
 
 void disk_close()
 {
-	if(diskfile) {
+	disk_wait();
+
+	if(backend) {
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+		if(model!=DISK_MODEL_NONE) printf("%.3f ms simulated device time\n",disk_elapsed());
+		uring_close();
+		stats_close();
+		delete backend;
+		backend = 0;
 	}
 }
-
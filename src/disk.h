@@ -1,12 +1,42 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdio.h>
+
 #define DISK_BLOCK_SIZE 4096
 
-int  disk_init( const char *filename, int nblocks );
+#define DISK_MODE_FILE 0
+#define DISK_MODE_MMAP 1
+#define DISK_MODE_RAM  2
+
+#define DISK_MODEL_NONE 0
+#define DISK_MODEL_HDD  1
+#define DISK_MODEL_SSD  2
+
+#define DISK_CLASS_DATA     0
+#define DISK_CLASS_SUPER    1
+#define DISK_CLASS_INODE    2
+#define DISK_CLASS_INDIRECT 3
+#define DISK_CLASS_BITMAP   4
+#define DISK_CLASSES        5
+
+int  disk_init( const char *filename, int nblocks, int mode = DISK_MODE_FILE );
 int  disk_size();
+char *disk_map( int blocknum );
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_readv( const int *blocknums, char * const *data, int count );
+void disk_writev( const int *blocknums, const char * const *data, int count );
+void disk_discard( int blocknum, int count );
+void disk_submit_read( int blocknum, char *data );
+void disk_submit_write( int blocknum, const char *data );
+void disk_start();
+void disk_wait();
+void disk_set_model( int model );
+double disk_elapsed();
+void disk_classify( int blocknum, int cls );
+int  disk_class( int blocknum );
+void disk_print_stats( FILE *file, int verbose );
 void disk_close();
 
 
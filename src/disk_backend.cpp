@@ -0,0 +1,163 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "disk.h"
+#include "disk_backend.h"
+
+/* blocos guardados num arquivo do sistema hospedeiro, com preadv/pwritev */
+class file_backend : public disk_backend {
+	int file;
+public:
+	file_backend( int f ) : file(f) {}
+	~file_backend() { close(file); }
+
+	int transfer( int blocknum, struct iovec *iov, int n, int write )
+	{
+		ssize_t result;
+		off_t offset = (off_t)blocknum*DISK_BLOCK_SIZE;
+
+		if(write) result = pwritev(file,iov,n,offset);
+		else result = preadv(file,iov,n,offset);
+
+		return result == (ssize_t)n*DISK_BLOCK_SIZE;
+	}
+
+	int discard( int blocknum, int n )
+	{
+		// o buraco continua ocupando o tamanho do arquivo, mas sem blocos alocados
+		return fallocate(file,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE,(off_t)n*DISK_BLOCK_SIZE)==0;
+	}
+
+	int fd() { return file; }
+};
+
+/* blocos guardados num vetor na memoria, acessos viram memcpy */
+class memory_backend : public disk_backend {
+protected:
+	char *blocks;
+	size_t length;
+public:
+	memory_backend( char *b, size_t l ) : blocks(b), length(l) {}
+
+	int transfer( int blocknum, struct iovec *iov, int n, int write )
+	{
+		int i;
+		char *block = blocks + (size_t)blocknum*DISK_BLOCK_SIZE;
+
+		for(i=0;i<n;i++,block+=DISK_BLOCK_SIZE) {
+			if(write) memcpy(block,iov[i].iov_base,DISK_BLOCK_SIZE);
+			else memcpy(iov[i].iov_base,block,DISK_BLOCK_SIZE);
+		}
+
+		return 1;
+	}
+
+	int discard( int blocknum, int n )
+	{
+		memset(map(blocknum),0,(size_t)n*DISK_BLOCK_SIZE);
+		return 1;
+	}
+
+	char *map( int blocknum ) { return blocks + (size_t)blocknum*DISK_BLOCK_SIZE; }
+};
+
+/* arquivo inteiro mapeado com mmap */
+class mmap_backend : public memory_backend {
+public:
+	mmap_backend( char *b, size_t l ) : memory_backend(b,l) {}
+	~mmap_backend()
+	{
+		msync(blocks,length,MS_SYNC);
+		munmap(blocks,length);
+	}
+
+	int discard( int blocknum, int n )
+	{
+		// MADV_REMOVE libera as paginas e o espaco no arquivo por baixo
+		if(madvise(map(blocknum),(size_t)n*DISK_BLOCK_SIZE,MADV_REMOVE)==0) return 1;
+		return memory_backend::discard(blocknum,n);
+	}
+};
+
+/*
+Disco so na memoria, para testes e medidas sem o ruido do sistema de
+arquivos hospedeiro. Se o arquivo existir, o conteudo inicial eh copiado dele,
+mas nada eh gravado de volta.
+*/
+class ram_backend : public memory_backend {
+public:
+	ram_backend( char *b, size_t l ) : memory_backend(b,l) {}
+	~ram_backend() { free(blocks); }
+};
+
+static int open_image( const char *filename, int nblocks )
+{
+	int fd;
+
+	if(nblocks<=0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = open(filename,O_RDWR|O_CREAT,0666);
+	if(fd<0) return -1;
+
+	if(ftruncate(fd,(off_t)nblocks*DISK_BLOCK_SIZE)<0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+disk_backend *disk_file_backend( const char *filename, int nblocks )
+{
+	int fd = open_image(filename,nblocks);
+	if(fd<0) return 0;
+
+	return new file_backend(fd);
+}
+
+disk_backend *disk_mmap_backend( const char *filename, int nblocks )
+{
+	size_t length = (size_t)nblocks*DISK_BLOCK_SIZE;
+	int fd = open_image(filename,nblocks);
+	if(fd<0) return 0;
+
+	void *p = mmap(0,length,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);	// o mapeamento continua valido sem o descritor
+	if(p==MAP_FAILED) return 0;
+
+	return new mmap_backend((char *)p,length);
+}
+
+disk_backend *disk_ram_backend( const char *filename, int nblocks )
+{
+	size_t length = (size_t)nblocks*DISK_BLOCK_SIZE;
+	size_t done = 0;
+	ssize_t result;
+	char *blocks;
+	int fd;
+
+	if(nblocks<=0) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	blocks = (char *) calloc(nblocks,DISK_BLOCK_SIZE);
+	if(!blocks) return 0;
+
+	fd = open(filename,O_RDONLY);
+	if(fd>=0) {
+		while(done<length && (result = read(fd,blocks+done,length-done))>0) done += result;
+		close(fd);
+	}
+
+	return new ram_backend(blocks,length);
+}
@@ -0,0 +1,35 @@
+#ifndef DISK_BACKEND_H
+#define DISK_BACKEND_H
+
+#include <sys/uio.h>
+
+/*
+Interface dos dispositivos que guardam os blocos do disco simulado.
+
+O disk.cpp cuida da validacao, contagem e agrupamento dos pedidos; o backend
+so precisa mover n blocos consecutivos a partir de blocknum, cada um num
+iovec de DISK_BLOCK_SIZE bytes.
+*/
+
+class disk_backend {
+public:
+	virtual ~disk_backend() {}
+
+	// retorna 1 se todos os blocos foram transferidos
+	virtual int transfer( int blocknum, struct iovec *iov, int n, int write ) = 0;
+
+	// faz os blocos passarem a ser lidos como zero; retorna 0 se nao souber
+	virtual int discard( int blocknum, int n ) { return 0; }
+
+	// ponteiro direto para o bloco, se o backend guardar os blocos em memoria
+	virtual char *map( int blocknum ) { return 0; }
+
+	// descritor usado pelo io_uring, ou -1 se o backend nao tiver arquivo
+	virtual int fd() { return -1; }
+};
+
+disk_backend *disk_file_backend( const char *filename, int nblocks );
+disk_backend *disk_mmap_backend( const char *filename, int nblocks );
+disk_backend *disk_ram_backend( const char *filename, int nblocks );
+
+#endif
@@ -1,5 +1,7 @@
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "bitmap.h"
 
 #include <iostream>
 #include <cstdlib>
@@ -9,6 +11,15 @@
 #include <vector>
 #include <cmath>
 #include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <chrono>
 
 const int FS_MAGIC           = 0xf0f03410;
 const int INODES_PER_BLOCK   = 128;
@@ -29,8 +40,58 @@ const int POINTERS_PER_BLOCK = 1024;
 
 bool MOUNTED = false;
 
-std::vector<int> data_bitmap;
-std::vector<int> inode_bitmap;
+/*
+Locks. Toda operacao publica pega fs_lock: exclusivo para o que mexe no fs
+inteiro (format, mount, sync, debug, fraginfo e a desfragmentacao, inclusive
+cada passo da de segundo plano), compartilhado para as operacoes de um
+arquivo. Estas pegam tambem o lock do inodo, compartilhado para ler e
+exclusivo para mudar o arquivo, entao arquivos diferentes andam em paralelo.
+O resto do estado global tem um mutex curto para cada parte. A ordem eh
+fs_lock, inodo, handle, e entao os mutexes curtos; entre dois inodos so se
+usa try_lock. defrag_control fica fora dessa ordem: so fs_defrag_start e
+fs_defrag_stop o pegam, sem nenhum outro lock, e ele eh segurado ate a thread
+de segundo plano terminar.
+*/
+std::shared_timed_mutex fs_lock;
+std::mutex alloc_lock;		//bitmaps de blocos e de inodos
+std::mutex meta_lock;		//copia da tabela de inodos e estado do superbloco
+std::mutex leaf_lock;		//cache de traducao dos indiretos
+std::mutex delayed_lock;	//mapa dos buffers da alocacao atrasada
+std::mutex handles_lock;	//tabela de arquivos abertos
+std::mutex defrag_control;	//inicio e fim da desfragmentacao de segundo plano
+
+struct fs_inode_lock {
+	std::shared_timed_mutex rw;
+	std::mutex stream;	//estado da leitura antecipada
+};
+
+std::vector<struct fs_inode_lock> inode_locks;
+
+/*
+Lock exclusivo de um inodo. Enquanto ele existe o inumber fica em
+held_inodes, para write_inode_table nao pegar de novo o lock de um inodo que
+a propria thread segura.
+*/
+thread_local std::vector<int> held_inodes;
+
+struct inode_write_lock {
+	std::unique_lock<std::shared_timed_mutex> lock;
+	int inumber;
+
+	explicit inode_write_lock(int i) : lock(inode_locks[i].rw), inumber(i) { held_inodes.push_back(i); }
+	inode_write_lock(int i, std::try_to_lock_t t) : lock(inode_locks[i].rw, t), inumber(i) {
+		if(lock.owns_lock())
+			held_inodes.push_back(i);
+	}
+	~inode_write_lock(){
+		if(lock.owns_lock())
+			held_inodes.erase(std::find(held_inodes.begin(), held_inodes.end(), inumber));
+	}
+	bool owns_lock() const { return lock.owns_lock(); }
+};
+
+bitmap data_bitmap;
+bitmap inode_bitmap;
 
 //DEBUG CLASS
 template<bool T>
@@ -38,640 +99,2340 @@ struct Debug{inline static void msg(std::string s){std::cout << "[DEBUG] " << s
 template<>
 struct Debug<false>{inline static void msg(std::string s){}};
 
+//imagens antigas tem zero nos campos depois de ninodes
+const int FS_FEATURE_BITMAPS = 1;	//bitmaps gravados logo depois da tabela de inodos
+const int FS_FEATURE_EXTENTS = 2;	//inodos guardam extents em vez de ponteiros
+const int FS_FEATURE_DEEP = 4;		//inodos com indiretos duplos e triplos
+const int FS_STATE_CLEAN = 1;		//bitmaps no disco estao em dia
+
 struct fs_superblock {
 	int magic;
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int features;
+	int state;
+	int ninodebitmapblocks;
+	int ndatabitmapblocks;
+};
+
+//sequencia de blocos fisicos consecutivos do arquivo
+struct fs_extent {
+	int start;
+	int length;
 };
 
+const int EXTENTS_PER_INODE = 2;
+const int EXTENTS_PER_BLOCK = DISK_BLOCK_SIZE / sizeof(struct fs_extent);
+
+/*
+Com FS_FEATURE_DEEP, os ponteiros do inodo sao DEEP_DIRECT_POINTERS diretos
+seguidos de um indireto simples, um duplo e um triplo. Sem ele, sao os
+POINTERS_PER_INODE diretos e um indireto simples das imagens antigas.
+*/
+const int DEEP_DIRECT_POINTERS = 3;
+const int DEEP_INDIRECT_LEVELS = 3;
+
+/*
+No formato com extents, a area dos ponteiros do inodo guarda os primeiros
+EXTENTS_PER_INODE extents, o bloco com os demais e o total de extents. Os
+extents cobrem o arquivo em ordem, sem buracos.
+*/
 struct fs_inode {
 	int isvalid;
 	int size;
-	int direct[POINTERS_PER_INODE];
-	int indirect;
+	union {
+		struct {
+			int direct[POINTERS_PER_INODE];
+			int indirect;
+		};
+		struct {
+			struct fs_extent extents[EXTENTS_PER_INODE];
+			int extentblock;
+			int nextents;
+		};
+		int pointers[POINTERS_PER_INODE + 1];	//diretos e indiretos em sequencia
+	};
 };
 
 union fs_block {
 	struct fs_superblock super;
 	struct fs_inode inode[INODES_PER_BLOCK];
 	int pointers[POINTERS_PER_BLOCK];
+	struct fs_extent extents[EXTENTS_PER_BLOCK];
 	char data[DISK_BLOCK_SIZE];
 };
 
-int fs_format()
-{
-	Debug<FORMAT_TRAIT>::msg("fs_format: ### BEGIN ###");
-	if(MOUNTED){
-		std::cout << "[ERROR] can't format, already mounted!" << std::endl;
-		return 0;
+/*
+Enquanto montado, o superbloco e a tabela de inodos ficam copiados na memoria.
+Alteracoes num inodo marcam o bloco de inodos dele como sujo, e os blocos
+sujos sao gravados juntos quando passam de INODE_FLUSH_BLOCKS ou em fs_sync().
+Cada inodo eh copiado para a gravacao com o lock dele compartilhado, entao
+nunca vai para o disco no meio de uma alteracao. Um inodo ocupado agora, por
+outra thread ou pela que grava (held_inodes), vai como foi gravado da ultima
+vez (inode_disk), e o bloco continua sujo.
+*/
+const int INODE_FLUSH_BLOCKS = 16;
+
+struct fs_superblock superblock;
+std::vector<union fs_block> inode_table;
+std::vector<union fs_block> inode_disk;	//a tabela como esta no disco
+std::vector<bool> inode_table_dirty;
+int inode_table_ndirty = 0;
+
+//grava os blocos sujos da tabela; chamada com meta_lock
+static void write_inode_table(){
+	std::vector<int> blocks;
+	std::vector<char> buffer;
+	int ndirty = 0;
+	for(size_t i = 0; i < inode_table.size(); i++){
+		if(!inode_table_dirty[i])
+			continue;
+		bool busy = false;
+		for(int j = 0; j < INODES_PER_BLOCK; j++){
+			size_t inumber = i * INODES_PER_BLOCK + j;
+			if(inumber >= inode_locks.size())
+				break;
+			//quem altera o inodo agora eh a propria thread
+			if(std::find(held_inodes.begin(), held_inodes.end(), (int)inumber) != held_inodes.end()){
+				busy = true;
+				continue;
+			}
+			//o lock do inodo vem antes de meta_lock, entao aqui so try_lock
+			std::shared_lock<std::shared_timed_mutex> lock(inode_locks[inumber].rw, std::try_to_lock);
+			if(lock.owns_lock())
+				inode_disk[i].inode[j] = inode_table[i].inode[j];
+			else
+				busy = true;
+		}
+		blocks.push_back(i + 1);
+		buffer.insert(buffer.end(), inode_disk[i].data, inode_disk[i].data + DISK_BLOCK_SIZE);
+		inode_table_dirty[i] = busy;
+		ndirty += busy;
 	}
+	cache_write_blocks(blocks.data(), blocks.size(), buffer.data());
+	inode_table_ndirty = ndirty;
+}
 
-	union fs_block block;
-	for(int i = 0; i < DISK_BLOCK_SIZE; i++){ 	//criando um bloco vazio, para utilizar no block.data
-		block.data[i] = 0;
-	}
+static void flush_inode_table(){
+	std::lock_guard<std::mutex> lock(meta_lock);
+	write_inode_table();
+}
 
-	for(int i = 0 ; i < disk_size(); i++) { //limpando o disco
-		disk_write(i,block.data);
+static void mark_inode_block(int iblock){
+	std::lock_guard<std::mutex> lock(meta_lock);
+	if(!inode_table_dirty[iblock]){
+		inode_table_dirty[iblock] = true;
+		inode_table_ndirty++;
 	}
+	if(inode_table_ndirty >= INODE_FLUSH_BLOCKS)
+		write_inode_table();
+}
 
-	Debug<FORMAT_TRAIT>::msg("fs_format: disk cleaned");
-	//criando o superbloco
-	block.super.magic = FS_MAGIC;
-	block.super.nblocks = disk_size();
-	block.super.ninodeblocks = std::ceil(block.super.nblocks/10.0);
-	block.super.ninodes = block.super.ninodeblocks * INODES_PER_BLOCK;
-	disk_write(0,block.data);
-	Debug<FORMAT_TRAIT>::msg("fs_format: ### END ###");
-	return 1;
+static struct fs_inode &get_inode(int inumber){
+	return inode_table[inumber / INODES_PER_BLOCK].inode[inumber % INODES_PER_BLOCK];
 }
 
-void fs_debug()
-{
-	Debug<DEBUG_TRAIT>::msg("fs_debug: ### BEGIN ###");
+static void mark_inode(int inumber){
+	mark_inode_block(inumber / INODES_PER_BLOCK);
+}
 
-	if(!MOUNTED) {
-		std::cout << "[ERROR] please mount first!" << std::endl;
-		return;
-	}
+//bits de bitmap que cabem num bloco do disco
+const int BITMAP_WORDS_PER_BLOCK = DISK_BLOCK_SIZE / sizeof(uint64_t);
+const int BITMAP_BITS_PER_BLOCK = DISK_BLOCK_SIZE * 8;
 
+static int inode_bitmap_start(const struct fs_superblock &super){
+	return super.ninodeblocks + 1;
+}
+
+static int data_bitmap_start(const struct fs_superblock &super){
+	return inode_bitmap_start(super) + super.ninodebitmapblocks;
+}
+
+//primeiro bloco depois dos metadados fixos (superbloco, inodos e bitmaps)
+static int data_start(const struct fs_superblock &super){
+	return data_bitmap_start(super) + super.ndatabitmapblocks;
+}
+
+static void write_superblock(){
 	union fs_block block;
+	std::memset(block.data, 0, DISK_BLOCK_SIZE);
+	block.super = superblock;
+	cache_write(0, block.data);
+}
+
+//grava os blocos do bitmap com algum grupo alterado, ou todos
+static void write_bitmap(bitmap &map, int start, int nblocks, bool all){
+	const int groups_per_block = BITMAP_WORDS_PER_BLOCK / BITMAP_GROUP_WORDS;
+	std::vector<int> blocks;
+	std::vector<char> buffer;
+	for(int i = 0; i < nblocks; i++){
+		bool dirty = all;
+		for(int g = i * groups_per_block; !dirty && g < (i + 1) * groups_per_block && g < map.group_count(); g++)
+			dirty = map.group_dirty(g);
+		if(!dirty)
+			continue;
+		size_t pos = buffer.size();
+		buffer.resize(pos + DISK_BLOCK_SIZE, 0);
+		int first = i * BITMAP_WORDS_PER_BLOCK;
+		int n = std::min(BITMAP_WORDS_PER_BLOCK, map.word_count() - first);
+		if(n > 0)
+			std::memcpy(&buffer[pos], map.data() + first, n * sizeof(uint64_t));
+		blocks.push_back(start + i);
+	}
+	cache_write_blocks(blocks.data(), blocks.size(), buffer.data());
+	map.clean();
+}
 
-	disk_read(0,block.data);
+static void read_bitmap(bitmap &map, int nbits, int start, int nblocks){
+	std::vector<int> blocks;
+	for(int i = 0; i < nblocks; i++)
+		blocks.push_back(start + i);
+	std::vector<uint64_t> words(nblocks * BITMAP_WORDS_PER_BLOCK);
+	cache_read_blocks(blocks.data(), blocks.size(), (char *)words.data());
+	map.load(nbits, words.data());
+}
 
-	if(block.super.magic != FS_MAGIC){
-		std::cout << "magic number is invalid" << std::endl;
+/*
+Antes da primeira alteracao depois de montar (ou de um fs_sync), o superbloco
+vai para o disco marcado como sujo. Se o programa cair antes do proximo
+fs_sync, o proximo mount nao confia nos bitmaps gravados e refaz a varredura.
+*/
+static void fs_modified(){
+	std::lock_guard<std::mutex> lock(meta_lock);
+	if(!(superblock.features & FS_FEATURE_BITMAPS) || superblock.state != FS_STATE_CLEAN)
 		return;
+	superblock.state = 0;
+	write_superblock();
+	cache_sync();
+}
+
+/*
+Alocador de blocos de dados. O disco eh dividido em grupos de
+BITMAP_GROUP_BITS blocos, os mesmos do resumo do bitmap. Um arquivo cresce a
+partir do bloco seguinte ao ultimo dele (o goal). Um arquivo novo comeca no
+primeiro bloco livre do seu grupo, para nao partir os trechos livres grandes.
+Com mais de um grupo, o grupo eh escolhido pelo inumber entre os que tem pelo
+menos a media de blocos livres, para arquivos diferentes nao crescerem
+intercalados. Os bitmaps ficam sob alloc_lock, segurado so durante a busca e
+a marcacao.
+*/
+static int new_file_goal(int inumber){
+	int ngroups = data_bitmap.group_count();
+	if(ngroups == 0 || data_bitmap.free_count() == 0)
+		return -1;
+	int group = 0;
+	if(ngroups > 1){
+		int average = data_bitmap.free_count() / ngroups;
+		group = inumber % ngroups;
+		for(int k = 0; k < ngroups; k++){
+			int g = (inumber + k) % ngroups;
+			if(data_bitmap.group_free(g) > 0 && data_bitmap.group_free(g) >= average){
+				group = g;
+				break;
+			}
+		}
 	}
+	int begin = std::max(group * BITMAP_GROUP_BITS, data_start(superblock));
+	return data_bitmap.find_free(begin);
+}
 
-	std::cout << "magic number is valid!" << std::endl;
-	std::cout << "superblock:" << std::endl;
-	std::cout << "\t" << block.super.nblocks << " blocks" << std::endl;
-	std::cout << "\t" << block.super.ninodeblocks << " inode blocks" << std::endl;
-	std::cout << "\t" << block.super.ninodes << " inodes" << std::endl;
+//aloca um bloco o mais perto possivel de goal; goal <= 0 para o primeiro bloco do arquivo
+static int alloc_block(int inumber, int goal){
+	std::lock_guard<std::mutex> lock(alloc_lock);
+	if(goal <= 0 || goal >= data_bitmap.size())
+		goal = new_file_goal(inumber);
+	int block = -1;
+	if(goal >= 0)
+		block = data_bitmap.alloc(goal);
+	if(block == -1)
+		block = data_bitmap.alloc();
+	return block;
+}
 
-	union fs_block inode;
+//aloca exatamente o bloco dado, se ele estiver livre
+static bool alloc_exact(int block){
+	std::lock_guard<std::mutex> lock(alloc_lock);
+	if(block >= data_bitmap.size() || data_bitmap[block] != 0)
+		return false;
+	data_bitmap.set(block);
+	return true;
+}
 
-	for (int i = 0; i < block.super.ninodes; i++) {
-		if(inode_bitmap[i] == 1) {
-			std::cout << "inode " << i << ":" << std::endl;
-			disk_read(i/INODES_PER_BLOCK + 1, inode.data);
+static void free_block(int block){
+	std::lock_guard<std::mutex> lock(alloc_lock);
+	data_bitmap.clear(block);
+}
 
-			std::cout << "\tsize: " << inode.inode[i%INODES_PER_BLOCK].size <<  " bytes";
+static int free_blocks(){
+	std::lock_guard<std::mutex> lock(alloc_lock);
+	return data_bitmap.free_count();
+}
 
-			bool have_direct = false;
+static bool extents_format(){
+	return superblock.features & FS_FEATURE_EXTENTS;
+}
 
-			for(int j = 0 ; j < POINTERS_PER_INODE; j++){
-				if(inode.inode[i%INODES_PER_BLOCK].direct[j] != 0){
-					if(!have_direct){std::cout << std::endl << "\tdirect blocks: "; have_direct = true;}
-					std::cout << inode.inode[i%INODES_PER_BLOCK].direct[j] << " ";
-				}
-			}
+const int MAX_EXTENTS = EXTENTS_PER_INODE + EXTENTS_PER_BLOCK;
 
-			if(inode.inode[i%INODES_PER_BLOCK].indirect != 0){
-				std::cout << std::endl << "\tindirect block: " << inode.inode[i%INODES_PER_BLOCK].indirect << std::endl;
+//extents de um inodo; mapblock eh o bloco de extents, se ja foi lido
+static void inode_extents(const struct fs_inode &inode, const union fs_block *mapblock, std::vector<struct fs_extent> &extents){
+	int n = std::max(0, std::min(inode.nextents, MAX_EXTENTS));
+	extents.assign(inode.extents, inode.extents + std::min(n, EXTENTS_PER_INODE));
+	if(n > EXTENTS_PER_INODE && mapblock)
+		extents.insert(extents.end(), mapblock->extents, mapblock->extents + n - EXTENTS_PER_INODE);
+}
 
-				union fs_block indirect;
-				disk_read(inode.inode[i%INODES_PER_BLOCK].indirect, indirect.data);
-				std::cout << "\tindirect data blocks: ";
-				for(int j = 0; j < POINTERS_PER_BLOCK; j++){
-					if(indirect.pointers[j] != 0){
-						std::cout << indirect.pointers[j] << " ";
-					}
-				}
-			}
-			std::cout << std::endl;
-		}
+static void load_extents(const struct fs_inode &inode, std::vector<struct fs_extent> &extents){
+	union fs_block block;
+	if(inode.nextents > EXTENTS_PER_INODE)
+		cache_read(inode.extentblock, block.data);
+	inode_extents(inode, &block, extents);
+}
 
+//grava os extents no inodo e o que passar de EXTENTS_PER_INODE no bloco de extents
+static void store_extents(int inumber, const std::vector<struct fs_extent> &extents){
+	struct fs_inode &inode = get_inode(inumber);
+	int n = extents.size();
+	for(int i = 0; i < EXTENTS_PER_INODE; i++)
+		inode.extents[i] = i < n ? extents[i] : fs_extent{0, 0};
+	if(n > EXTENTS_PER_INODE){
+		union fs_block block;
+		std::memset(block.data, 0, DISK_BLOCK_SIZE);
+		std::copy(extents.begin() + EXTENTS_PER_INODE, extents.end(), block.extents);
+		cache_write(inode.extentblock, block.data);
 	}
+	inode.nextents = n;
+	mark_inode(inumber);
+}
 
-	Debug<DEBUG_TRAIT>::msg("fs_debug: ### END ###");
+//blocos fisicos dos blocos logicos de begin_block a end_block, ate o fim dos extents
+static void extent_blocks(const std::vector<struct fs_extent> &extents, int begin_block, int end_block, std::vector<int> &blocks){
+	int logical = 0;
+	for(auto &e : extents){
+		for(int i = std::max(begin_block, logical); i <= end_block && i < logical + e.length; i++)
+			blocks.push_back(e.start + i - logical);
+		logical += e.length;
+		if(logical > end_block)
+			break;
+	}
 }
 
-int fs_mount()
-{
-	Debug<MOUNT_TRAIT>::msg("fs_mount: ### BEGIN ###");
-	union fs_block block;
+static bool deep_format(){
+	return superblock.features & FS_FEATURE_DEEP;
+}
 
-	disk_read(0,block.data);
+//no formato com ponteiros: quantos ponteiros do inodo sao diretos, e quantos niveis de indiretos vem depois
+static int direct_pointers(){
+	return deep_format() ? DEEP_DIRECT_POINTERS : POINTERS_PER_INODE;
+}
 
-	data_bitmap.resize(block.super.nblocks, 0);
-	inode_bitmap.resize(block.super.ninodes, 0);
+static int indirect_levels(){
+	return deep_format() ? DEEP_INDIRECT_LEVELS : 1;
+}
 
-	if(block.super.magic != FS_MAGIC){
-		Debug<MOUNT_TRAIT>::msg("fs_mount: magic number invalid");
-		return 0;
-	}
+//nivel da arvore pendurada num ponteiro do inodo: 0 para os diretos
+static int pointer_level(int slot){
+	return slot < direct_pointers() ? 0 : slot - direct_pointers() + 1;
+}
 
-	Debug<MOUNT_TRAIT>::msg("fs_mount: magic number valid");
+/*
+Um slot eh o lugar onde fica um ponteiro para bloco: um dos ponteiros do
+inodo (parent == 0) ou uma posicao dentro de um bloco indireto. Num inodo com
+extents o dono de um bloco de dados eh {inumber, -1, numero do extent}, e o
+do bloco de extents eh {inumber, -1, -1}.
+*/
+struct fs_slot {
+	int inumber;
+	int parent;
+	int index;
+};
 
-	Debug<MOUNT_TRAIT>::msg("fs_mount: CONSTRUCTING INODE BITMAP");
+/*
+Mapa reverso: para cada bloco, o slot que aponta para ele (inumber 0 se o
+bloco nao eh de ninguem). Ele eh montado na primeira consulta, lendo as
+arvores de todos os inodos uma vez, e depois mantido em dia por quem aloca,
+libera ou muda blocos de lugar, para o mount continuar sem ler os indiretos.
+*/
+std::vector<struct fs_slot> owners;
+bool owners_built = false;
+
+static void owner_set(int block, const struct fs_slot &slot){
+	if(owners_built)
+		owners[block] = slot;
+}
 
-	union fs_block inode;
-	for(int i = 0 ; i < block.super.ninodeblocks ; i++){
-		disk_read(i+1, inode.data);
-		for(int j = 0; j < INODES_PER_BLOCK; j++){
-			if(inode.inode[j].isvalid == 1){
-				inode_bitmap[i*INODES_PER_BLOCK + j] = 1;
-				Debug<MOUNT_TRAIT>::msg("fs_mount: inode " + std::to_string(i*INODES_PER_BLOCK + j) + " valid!");
-				}
-			else
-				inode_bitmap[i*INODES_PER_BLOCK + j] = 0;
+static void owner_clear(int block){
+	if(owners_built)
+		owners[block] = fs_slot{0, 0, 0};
+}
+
+static void owner_build_tree(int inumber, int node, int level){
+	union fs_block block;
+	cache_read(node, block.data);
+	for(int i = 0; i < POINTERS_PER_BLOCK; i++){
+		if(block.pointers[i] == 0)
+			continue;
+		owners[block.pointers[i]] = fs_slot{inumber, node, i};
+		if(level > 1)
+			owner_build_tree(inumber, block.pointers[i], level - 1);
+	}
+}
+
+static void owner_build(){
+	owners.assign(superblock.nblocks, fs_slot{0, 0, 0});
+	for(int i = 1; i < superblock.ninodes; i++){
+		if(inode_bitmap[i] == 0)
+			continue;
+		struct fs_inode &inode = get_inode(i);
+		if(extents_format()){
+			std::vector<struct fs_extent> extents;
+			load_extents(inode, extents);
+			for(size_t k = 0; k < extents.size(); k++)
+				for(int b = 0; b < extents[k].length; b++)
+					owners[extents[k].start + b] = fs_slot{i, -1, (int)k};
+			if(inode.extentblock != 0)
+				owners[inode.extentblock] = fs_slot{i, -1, -1};
+			continue;
+		}
+		for(int p = 0; p < direct_pointers() + indirect_levels(); p++){
+			if(inode.pointers[p] == 0)
+				continue;
+			owners[inode.pointers[p]] = fs_slot{i, 0, p};
+			if(pointer_level(p) > 0)
+				owner_build_tree(i, inode.pointers[p], pointer_level(p));
 		}
 	}
+	owners_built = true;
+}
 
-	Debug<MOUNT_TRAIT>::msg("fs_mount: CONSTRUCTING DATA BITMAP");
+//slot que aponta para block; false se o bloco nao eh de nenhum arquivo
+static bool owner_find(int block, struct fs_slot &slot){
+	if(!owners_built)
+		owner_build();
+	slot = owners[block];
+	return slot.inumber != 0;
+}
 
-	for (int i = 0; i < block.super.ninodes; i++) {
-		if(inode_bitmap[i] == 1) {
-			disk_read(i/INODES_PER_BLOCK + 1, inode.data);
-			for(int j = 0 ; j < POINTERS_PER_INODE; j++){
-				if(inode.inode[i%INODES_PER_BLOCK].direct[j] != 0){
-					data_bitmap[inode.inode[i%INODES_PER_BLOCK].direct[j]] = 1;
-					Debug<MOUNT_TRAIT>::msg("fs_mount: inode " + std::to_string(i) + " has direct " + std::to_string(inode.inode[i%INODES_PER_BLOCK].direct[j]) + " being used!");
-				}
-			}
-			if(inode.inode[i%INODES_PER_BLOCK].indirect != 0){
-				Debug<MOUNT_TRAIT>::msg("fs_mount: inode " + std::to_string(i) + " indirect block point to " + std::to_string(inode.inode[i%INODES_PER_BLOCK].indirect) + " block!");
-				data_bitmap[inode.inode[i%INODES_PER_BLOCK].indirect] = 1;
-				union fs_block indirect;
-				disk_read(inode.inode[i%INODES_PER_BLOCK].indirect, indirect.data);
-				for(int j = 0; j < POINTERS_PER_BLOCK; j++){
-					if(indirect.pointers[j] != 0){
-						data_bitmap[indirect.pointers[j]] = 1;
-						Debug<MOUNT_TRAIT>::msg("fs_mount: 	indirect " + std::to_string(indirect.pointers[j]) + " block being pointed!");
-					}
-				}
+/*
+Aloca os blocos que faltam ate end_block (o arquivo nao tem buracos) e devolve
+os blocos fisicos de begin_block a end_block. Um bloco novo estende o ultimo
+extent se o bloco seguinte a ele estiver livre; senao comeca outro extent.
+Se hint > 0, o primeiro bloco novo vai para hint em vez de seguir o ultimo extent.
+*/
+static void extent_allocate(int inumber, int begin_block, int end_block, std::vector<int> &blocks, std::vector<bool> &fresh, bool &full, bool &nospace, int hint = 0){
+	struct fs_inode &inode = get_inode(inumber);
+	std::vector<struct fs_extent> extents;
+	load_extents(inode, extents);
+
+	int allocated = 0;
+	for(auto &e : extents)
+		allocated += e.length;
+
+	bool changed = false;
+	for(int i = allocated; i <= end_block; i++){
+		int end = extents.empty() ? 0 : extents.back().start + extents.back().length;
+		int goal = (i == allocated && hint > 0) ? hint : end;
+		if(!extents.empty() && goal == end && alloc_exact(goal)){
+			owner_set(goal, fs_slot{inumber, -1, (int)extents.size() - 1});
+			extents.back().length++;
+			changed = true;
+			continue;
+		}
+		if((int)extents.size() == MAX_EXTENTS){
+			full = true;
+			break;
+		}
+		if((int)extents.size() == EXTENTS_PER_INODE && inode.extentblock == 0){
+			int free_block = alloc_block(inumber, 0);
+			if(free_block == -1){
+				nospace = true;
+				break;
 			}
+			inode.extentblock = free_block;
+			owner_set(free_block, fs_slot{inumber, -1, -1});
+			disk_classify(free_block, DISK_CLASS_INDIRECT);
+			mark_inode(inumber);
+			Debug<WRITE_TRAIT>::msg("fs_write: extent block allocated at " + std::to_string(free_block));
 		}
+		int free_block = alloc_block(inumber, goal);
+		if(free_block == -1){
+			nospace = true;
+			break;
+		}
+		owner_set(free_block, fs_slot{inumber, -1, (int)extents.size()});
+		extents.push_back(fs_extent{free_block, 1});
+		changed = true;
 	}
-	Debug<MOUNT_TRAIT>::msg("fs_mount: FILLING DATA BITMAP WITH INODES AND SUPER BLOCKS");
-	data_bitmap[0] = 1;
-	for(int i = 0; i < block.super.ninodeblocks; i++)
-		data_bitmap[i+1] = 1;
-
-	MOUNTED = true;
-
-	#if MOUNT_TRAIT == 1
-		for(auto i : data_bitmap)
-			std::cout << i;
-		std::cout << " --> data_bitmap" << std::endl;
-		for(auto i : inode_bitmap)
-			std::cout << i;
-		std::cout << " --> inode_bitmap" << std::endl;
-	#endif
+	if(changed)
+		store_extents(inumber, extents);
 
-	Debug<MOUNT_TRAIT>::msg("fs_mount: ### END ###");
-	return 1;
+	extent_blocks(extents, begin_block, end_block, blocks);
+	for(size_t i = 0; i < blocks.size(); i++)
+		fresh.push_back(begin_block + (int)i >= allocated);
 }
 
-int fs_create()
-{
-	if(!MOUNTED) {
-		std::cout << "[ERROR] please mount first!" << std::endl;
-		return 0;
+//acha o ponteiro do inodo que cobre o bloco logico n, e o indice de n dentro da arvore dele
+static bool pointer_position(int n, int &slot, int &level, int &index){
+	int ndirect = direct_pointers();
+	if(n < ndirect){
+		slot = n;
+		level = 0;
+		index = 0;
+		return true;
 	}
-	for(int i = 1; i < inode_bitmap.size(); i++) { //começa em 1 pq o inode 0 eh invalido
-		if(inode_bitmap[i] == 0) {
-			union fs_block inode;
-			disk_read(i / INODES_PER_BLOCK + 1,inode.data);	// le o bloco inteiro de inodo onde o inodo ta, pq
-			int inode_index = i % INODES_PER_BLOCK;			// o disk_write apenas escreve em 1 bloco de 4KB, e nao
-			inode.inode[inode_index].isvalid = 1;	        // em apenas 1 inodo
-			inode.inode[inode_index].size = 0;
-			for(int j = 0; j < POINTERS_PER_INODE; j++)
-				inode.inode[inode_index].direct[j] = 0;
-			inode.inode[inode_index].indirect = 0;
-			inode_bitmap[i] = 1;							// atualiza o bitmap
-			disk_write(i/INODES_PER_BLOCK + 1, inode.data); // escreve o bloco inteiro com o inodo atualizado
-			return i;
+	n -= ndirect;
+	long span = 1;
+	for(level = 1; level <= indirect_levels(); level++){
+		span *= POINTERS_PER_BLOCK;
+		if(n < span){
+			slot = ndirect + level - 1;
+			index = n;
+			return true;
 		}
+		n -= span;
 	}
-	std::cout << "[ERROR] no available inode" << std::endl;
-	return 0;
+	return false;
 }
 
-int fs_delete( int inumber )
-{
+/*
+Cache de traducao dos indiretos: para um inodo e um trecho de
+POINTERS_PER_BLOCK blocos logicos, guarda qual bloco indireto de ultimo nivel
+tem os ponteiros deles. Um acesso aleatorio longe do inicio de um arquivo
+grande le so esse bloco, em vez da cadeia inteira a partir do inodo.
+*/
+const int LEAF_CACHE_SIZE = 64;
+
+struct leaf_entry {
+	int inumber;
+	int slot;
+	int region;
+	int block;
+};
 
-	Debug<DELETE_TRAIT>::msg("fs_delete: ### BEGIN ###");
-	if(!MOUNTED) {
-		std::cout << "[ERROR] please mount first!" << std::endl;
-		return 0;
-	}
-	Debug<DELETE_TRAIT>::msg("fs_delete: checking inumber value");
-	union fs_block block;
-	disk_read(0, block.data);
-	if(inumber == 0 || inumber > block.super.ninodes){
-		std::cout << "[ERROR] inumber out of bounds!" << std::endl;
+static struct leaf_entry leaf_cache[LEAF_CACHE_SIZE];
+
+static struct leaf_entry &leaf_cache_entry(int inumber, int slot, int region){
+	unsigned hash = (unsigned)inumber * 31 + (unsigned)slot * 7 + (unsigned)region;
+	return leaf_cache[hash % LEAF_CACHE_SIZE];
+}
+
+//esquece as traducoes de um inodo, ou de todos com inumber < 0
+static void leaf_cache_forget(int inumber){
+	std::lock_guard<std::mutex> lock(leaf_lock);
+	for(int i = 0; i < LEAF_CACHE_SIZE; i++)
+		if(inumber < 0 || leaf_cache[i].inumber == inumber)
+			leaf_cache[i].block = 0;
+}
+
+//aloca um bloco indireto zerado perto de goal, e avanca goal para depois dele
+static int new_indirect_block(int inumber, int &goal){
+	int block = alloc_block(inumber, goal);
+	if(block == -1)
 		return 0;
+	goal = block + 1;
+	union fs_block zero;
+	std::memset(zero.data, 0, DISK_BLOCK_SIZE);
+	cache_write(block, zero.data);
+	disk_classify(block, DISK_CLASS_INDIRECT);
+	return block;
+}
+
+/*
+Bloco indireto de ultimo nivel com o ponteiro do indice dado, na arvore do
+ponteiro slot do inodo. Com goal, os niveis que faltam sao criados no caminho,
+perto de goal; sem goal devolve 0 quando a arvore nao chega ate la.
+*/
+static int leaf_block(int inumber, int slot, int level, int index, int *goal){
+	int region = index / POINTERS_PER_BLOCK;
+	{
+		std::lock_guard<std::mutex> lock(leaf_lock);
+		struct leaf_entry &entry = leaf_cache_entry(inumber, slot, region);
+		if(entry.block != 0 && entry.inumber == inumber && entry.slot == slot && entry.region == region)
+			return entry.block;
 	}
-	if(inode_bitmap[inumber] == 0){
-		std::cout << "[ERROR] inode is not valid!" << std::endl;
-		return 0;
+
+	struct fs_inode &inode = get_inode(inumber);
+	if(inode.pointers[slot] == 0){
+		if(!goal || (inode.pointers[slot] = new_indirect_block(inumber, *goal)) == 0)
+			return 0;
+		owner_set(inode.pointers[slot], fs_slot{inumber, 0, slot});
+		mark_inode(inumber);
 	}
-	union fs_block inode;
-	union fs_block data;
-	for(int i = 0; i < DISK_BLOCK_SIZE; i++){ 	//criando um bloco vazio, para utilizar no block.data
-		data.data[i] = 0;
+
+	int block = inode.pointers[slot];
+	int span = 1;
+	for(int l = 1; l < level; l++)
+		span *= POINTERS_PER_BLOCK;
+	for(int l = level; l > 1; l--){
+		union fs_block node;
+		cache_read(block, node.data);
+		int &child = node.pointers[(index / span) % POINTERS_PER_BLOCK];
+		if(child == 0){
+			if(!goal || (child = new_indirect_block(inumber, *goal)) == 0)
+				return 0;
+			owner_set(child, fs_slot{inumber, block, (index / span) % POINTERS_PER_BLOCK});
+			cache_write(block, node.data);
+		}
+		block = child;
+		span /= POINTERS_PER_BLOCK;
 	}
 
-	disk_read(inumber/INODES_PER_BLOCK + 1, inode.data);
-	int inode_index = inumber % INODES_PER_BLOCK;
+	std::lock_guard<std::mutex> lock(leaf_lock);
+	leaf_cache_entry(inumber, slot, region) = leaf_entry{inumber, slot, region, block};
+	return block;
+}
 
-	inode.inode[inode_index].isvalid = 0;		//comecando a deletar e liberar os blocos
-	inode.inode[inode_index].size = 0;
-	Debug<DELETE_TRAIT>::msg("fs_delete: cleaning direct pointers");
-	for(int i = 0; i < POINTERS_PER_INODE; i++){	//limpando os ponteiros diretos e seus blocos
-		if(inode.inode[inode_index].direct[i] != 0){
-			Debug<DELETE_TRAIT>::msg("fs_delete: found direct block " + std::to_string(inode.inode[inode_index].direct[i]) + " at direct pointer " + std::to_string(i));
-			disk_write(inode.inode[inode_index].direct[i], data.data);
-			data_bitmap[inode.inode[inode_index].direct[i]] = 0;
-			inode.inode[inode_index].direct[i] = 0;
+//blocos fisicos de begin_block a end_block no formato com ponteiros, ate o primeiro buraco
+static void pointer_blocks(int inumber, int begin_block, int end_block, std::vector<int> &blocks){
+	struct fs_inode &inode = get_inode(inumber);
+	int n = begin_block;
+	while(n <= end_block){
+		int slot, level, index;
+		if(!pointer_position(n, slot, level, index))
+			return;
+		if(level == 0){
+			if(inode.pointers[slot] == 0)
+				return;
+			blocks.push_back(inode.pointers[slot]);
+			n++;
+			continue;
+		}
+		Debug<READ_TRAIT>::msg("fs_read: reading from level " + std::to_string(level) + " indirects");
+		int leaf = leaf_block(inumber, slot, level, index, NULL);
+		if(leaf == 0)
+			return;
+		union fs_block node;
+		cache_read(leaf, node.data);
+		for(int i = index % POINTERS_PER_BLOCK; i < POINTERS_PER_BLOCK && n <= end_block; i++, n++){
+			if(node.pointers[i] == 0)
+				return;
+			blocks.push_back(node.pointers[i]);
 		}
 	}
+}
+
+//aloca os blocos de begin_block a end_block no formato com ponteiros, criando os indiretos que faltarem;
+//hint > 0 substitui o goal do primeiro bloco novo
+static void pointer_allocate(int inumber, int begin_block, int end_block, std::vector<int> &blocks, std::vector<bool> &fresh, bool &full, bool &nospace, int hint = 0){
+	struct fs_inode &inode = get_inode(inumber);
+
+	//o goal eh o bloco seguinte ao ultimo bloco do arquivo antes do trecho
+	int goal = 0;
+	if(hint > 0){
+		goal = hint;
+	} else if(begin_block > 0){
+		std::vector<int> previous;
+		pointer_blocks(inumber, begin_block - 1, begin_block - 1, previous);
+		if(!previous.empty())
+			goal = previous[0] + 1;
+	}
 
-	if(inode.inode[inode_index].indirect != 0){
-		Debug<DELETE_TRAIT>::msg("fs_delete: inode have indirect block at " + std::to_string(inode.inode[inode_index].indirect));
-		union fs_block indirect;
-		disk_read(inode.inode[inode_index].indirect, indirect.data);
-		for(int i = 0 ; i < POINTERS_PER_BLOCK; i++) {
-			if (indirect.pointers[i] != 0) {
-				Debug<DELETE_TRAIT>::msg("fs_delete: found indirect block " + std::to_string(indirect.pointers[i]));
-				disk_write(indirect.pointers[i], data.data);
-				data_bitmap[indirect.pointers[i]] = 0;
-				indirect.pointers[i] = 0;
+	int n = begin_block;
+	while(n <= end_block && !nospace){
+		int slot, level, index;
+		if(!pointer_position(n, slot, level, index)){
+			full = true;
+			return;
+		}
+		if(level == 0){
+			fresh.push_back(inode.pointers[slot] == 0);
+			if(inode.pointers[slot] == 0){
+				int free_block = alloc_block(inumber, goal);
+				if(free_block == -1){
+					fresh.pop_back();
+					nospace = true;
+					return;
+				}
+				inode.pointers[slot] = free_block;
+				owner_set(free_block, fs_slot{inumber, 0, slot});
+				mark_inode(inumber);
+				hint = 0;
+			}
+			blocks.push_back(inode.pointers[slot]);
+			if(hint == 0)
+				goal = inode.pointers[slot] + 1;
+			n++;
+			continue;
+		}
+		int before = goal;
+		int leaf = leaf_block(inumber, slot, level, index, &goal);
+		if(goal != before)
+			hint = 0;
+		if(leaf == 0){
+			nospace = true;
+			return;
+		}
+		union fs_block node;
+		bool dirty = false;
+		cache_read(leaf, node.data);
+		for(int i = index % POINTERS_PER_BLOCK; i < POINTERS_PER_BLOCK && n <= end_block; i++, n++){
+			fresh.push_back(node.pointers[i] == 0);
+			if(node.pointers[i] == 0){
+				int free_block = alloc_block(inumber, goal);
+				if(free_block == -1){
+					fresh.pop_back();
+					nospace = true;
+					break;
+				}
+				node.pointers[i] = free_block;
+				owner_set(free_block, fs_slot{inumber, leaf, i});
+				dirty = true;
+				hint = 0;
 			}
+			blocks.push_back(node.pointers[i]);
+			if(hint == 0)
+				goal = node.pointers[i] + 1;
 		}
-		disk_write(inode.inode[inode_index].indirect, data.data);
-		data_bitmap[inode.inode[inode_index].indirect] = 0;
-		inode.inode[inode_index].indirect = 0;
+		if(dirty)
+			cache_write(leaf, node.data);
 	}
+}
 
-	inode_bitmap[inumber] = 0;
-	disk_write(inumber/INODES_PER_BLOCK + 1, inode.data);
-	Debug<DELETE_TRAIT>::msg("fs_delete: ### END ###");
-	return 1;
+//zera e libera um bloco e, se for indireto de nivel level, tudo abaixo dele
+static void free_tree(int block, int level, const union fs_block &zero){
+	if(level > 0){
+		union fs_block node;
+		cache_read(block, node.data);
+		for(int i = 0 ; i < POINTERS_PER_BLOCK; i++)
+			if(node.pointers[i] != 0)
+				free_tree(node.pointers[i], level - 1, zero);
+		disk_classify(block, DISK_CLASS_DATA);
+	}
+	Debug<DELETE_TRAIT>::msg("fs_delete: freeing level " + std::to_string(level) + " block " + std::to_string(block));
+	cache_write(block, zero.data);
+	free_block(block);
+	owner_clear(block);
 }
 
-int fs_getsize( int inumber )
-{
+/*
+Onde comecar a reserva de need blocos: no goal natural do arquivo se o trecho
+inteiro cabe ali, senao no primeiro trecho livre em que caiba, senao no maior
+trecho livre do disco, para a reserva ficar no menor numero de pedacos.
+*/
+static int reserve_goal(int inumber, int goal, int need){
+	std::lock_guard<std::mutex> lock(alloc_lock);
+	if(goal <= 0)
+		goal = new_file_goal(inumber);
+	if(goal <= 0)
+		return 0;
+	int start = data_bitmap.find_free_run(goal, need);
+	if(start == -1)
+		start = data_bitmap.find_free_run(data_start(superblock), need);
+	if(start == -1)
+		data_bitmap.largest_free_run(data_start(superblock), data_bitmap.size(), start);
+	return std::max(start, 0);
+}
 
-	Debug<GETSIZE_TRAIT>::msg("fs_getsize: ### BEGIN ###");
+/*
+Goal para alocar os blocos que ainda faltam de begin_block a end_block de uma
+vez; need recebe quantos blocos serao alocados, contando os indiretos.
+*/
+static int range_hint(int inumber, int begin_block, int end_block, int &need){
+	//o que ja esta alocado no comeco do trecho nao entra na conta
+	int goal = 0;
+	if(extents_format()){
+		std::vector<struct fs_extent> extents;
+		load_extents(get_inode(inumber), extents);
+		int allocated = 0;
+		for(auto &e : extents)
+			allocated += e.length;
+		if(!extents.empty())
+			goal = extents.back().start + extents.back().length;
+		need = end_block + 1 - allocated;
+	} else {
+		std::vector<int> existing;
+		pointer_blocks(inumber, begin_block, end_block, existing);
+		if(existing.empty() && begin_block > 0)
+			pointer_blocks(inumber, begin_block - 1, begin_block - 1, existing);
+		else
+			begin_block += existing.size();
+		if(!existing.empty())
+			goal = existing.back() + 1;
+		need = end_block + 1 - begin_block;
+		//mais os indiretos, que sao alocados no meio dos dados
+		if(need > 0 && end_block >= direct_pointers())
+			need += need / POINTERS_PER_BLOCK + 1;
+		if(need > 0 && end_block >= direct_pointers() + POINTERS_PER_BLOCK)
+			need += need / (POINTERS_PER_BLOCK * POINTERS_PER_BLOCK) + 1;
+	}
+	if(need <= 0)
+		return 0;
+	return reserve_goal(inumber, goal, need);
+}
 
- 	if(!MOUNTED) {
- 		std::cout << "[ERROR] please mount first!" << std::endl;
- 		return -1;
- 	}
+/*
+Alocacao atrasada. Os blocos escritos depois do fim do arquivo ficam num
+buffer na memoria, sem bloco fisico, e so sao alocados quando o buffer eh
+gravado: ai o tamanho do trecho ja eh conhecido e ele vai para um trecho
+livre so, com os ponteiros atualizados de uma vez. O buffer de um inodo eh
+gravado quando passa de DELAYED_FILE_BLOCKS, quando uma escrita ou leitura
+cai fora dele, e em fs_sync(). Quando o total passa de DELAYED_MAX_BLOCKS sao
+gravados os buffers dos outros arquivos que nao estao em uso; se nao bastar,
+a escrita vai direto para o disco. O mapa fica sob delayed_lock, e o buffer
+de um inodo so eh mexido com o lock exclusivo dele.
+*/
+const int DELAYED_FILE_BLOCKS = 1024;
+const int DELAYED_MAX_BLOCKS = 8192;
+
+struct delayed_file {
+	int first;			//bloco logico do comeco do buffer
+	std::vector<char> data;		//blocos inteiros; o que nao foi escrito fica zerado
+};
 
-	union fs_block block;
-	disk_read(0,block.data);
+std::map<int, struct delayed_file> delayed;
+int delayed_blocks = 0;
 
-	int n_blocks = 0;
+//blocos que a gravacao dos buffers pode precisar, com uma folga para os indiretos
+static int delayed_need(int nblocks){
+	return nblocks + nblocks / POINTERS_PER_BLOCK + 3 * (delayed.size() + 1);
+}
 
-	if(inumber < block.super.ninodes && inode_bitmap[inumber] != 0){
+//bloco logico do comeco do buffer do inodo, ou -1 se ele nao tem buffer
+static int delayed_first(int inumber){
+	std::lock_guard<std::mutex> lock(delayed_lock);
+	auto it = delayed.find(inumber);
+	return it == delayed.end() ? -1 : it->second.first;
+}
 
-		union fs_block inode;
-		disk_read(inumber/INODES_PER_BLOCK + 1, inode.data);
-		for(int i = 0;i < POINTERS_PER_INODE; i++){
-			if(inode.inode[inumber%INODES_PER_BLOCK].direct[i] != 0)
-				n_blocks++;
-		}
-		if(inode.inode[inumber%INODES_PER_BLOCK].indirect != 0){
-			union fs_block indirect;
-			disk_read(inode.inode[inumber%INODES_PER_BLOCK].indirect, indirect.data);
-			for(int i = 0; i < POINTERS_PER_BLOCK; i++){
-				if(indirect.pointers[i] != 0)
-					n_blocks++;
-			}
-		}
-		return n_blocks * 4096;
+//aloca e grava o buffer do inodo
+static void delayed_flush(int inumber){
+	struct delayed_file *found;
+	{
+		std::lock_guard<std::mutex> lock(delayed_lock);
+		auto it = delayed.find(inumber);
+		if(it == delayed.end())
+			return;
+		found = &it->second;
+	}
+	struct delayed_file &pending = *found;
+	int nblocks = pending.data.size() / DISK_BLOCK_SIZE;
+	int end_block = pending.first + nblocks - 1;
+
+	fs_modified();
+
+	int need;
+	int hint = range_hint(inumber, pending.first, end_block, need);
+	Debug<WRITE_TRAIT>::msg("delayed_flush: inode " + std::to_string(inumber) + " blocks " + std::to_string(pending.first) + "-" + std::to_string(end_block) + " at " + std::to_string(hint));
+
+	std::vector<int> blocks;
+	std::vector<bool> fresh;
+	bool full = false, nospace = false;
+	if(extents_format())
+		extent_allocate(inumber, pending.first, end_block, blocks, fresh, full, nospace, hint);
+	else
+		pointer_allocate(inumber, pending.first, end_block, blocks, fresh, full, nospace, hint);
+
+	if(!blocks.empty())
+		cache_write_blocks(blocks.data(), blocks.size(), pending.data.data());
+
+	//o que nao coube se perde, e o tamanho volta para o que foi gravado
+	if(nospace || full){
+		std::cout << "[ERROR] " << (nospace ? "there is no free space anymore" : "file reached the maximum size") << std::endl;
+		struct fs_inode &inode = get_inode(inumber);
+		inode.size = std::min(inode.size, (pending.first + (int)blocks.size()) * DISK_BLOCK_SIZE);
+		mark_inode(inumber);
 	}
 
-	Debug<GETSIZE_TRAIT>::msg("fs_getsize: ### END ###");
+	std::lock_guard<std::mutex> lock(delayed_lock);
+	delayed_blocks -= nblocks;
+	delayed.erase(inumber);
+}
 
- 	return -1;
+//so com o fs inteiro travado (fs_lock exclusivo)
+static void delayed_flush_all(){
+	while(!delayed.empty())
+		delayed_flush(delayed.begin()->first);
 }
 
-int fs_read( int inumber, char *data, int length, int offset )
-{
-	Debug<READ_TRAIT>::msg("fs_read: ### BEGIN ###");
-	if(!MOUNTED) {
-		std::cout << "[ERROR] please mount first!" << std::endl;
-		return 0;
-	}
-	Debug<READ_TRAIT>::msg("fs_read: checking inumber value");
-	union fs_block block;
-	disk_read(0, block.data);
-	if(inumber == 0 || inumber > block.super.ninodes){
-		std::cout << "[ERROR] inumber out of bounds!" << std::endl;
-		return 0;
+//grava os buffers dos outros inodos que nao estao em uso agora
+static void delayed_flush_others(int inumber){
+	std::vector<int> others;
+	{
+		std::lock_guard<std::mutex> lock(delayed_lock);
+		for(auto &entry : delayed)
+			if(entry.first != inumber)
+				others.push_back(entry.first);
 	}
-	if(inode_bitmap[inumber] == 0){
-		std::cout << "[ERROR] inode is not valid!" << std::endl;
-		return 0;
+	for(int other : others){
+		inode_write_lock busy(other, std::try_to_lock);
+		if(busy.owns_lock())
+			delayed_flush(other);
 	}
+}
 
-	Debug<READ_TRAIT>::msg("fs_read: begin reading data: \n\tinumber = " + std::to_string(inumber) + "\n\tlength = " + std::to_string(length) + "\n\toffset = " + std::to_string(offset));
-
-	union fs_block inode, data_block;
-
-	disk_read(inumber/INODES_PER_BLOCK + 1, inode.data);
-	int inode_index = inumber % INODES_PER_BLOCK;
+//descarta o buffer do inodo sem gravar
+static void delayed_forget(int inumber){
+	std::lock_guard<std::mutex> lock(delayed_lock);
+	auto it = delayed.find(inumber);
+	if(it == delayed.end())
+		return;
+	delayed_blocks -= it->second.data.size() / DISK_BLOCK_SIZE;
+	delayed.erase(it);
+}
 
+/*
+Guarda a escrita no buffer do inodo se ela comeca no fim do buffer ou, sem
+buffer, no primeiro bloco depois do fim do arquivo. Devolve false quando a
+escrita tem que ir para o disco agora.
+*/
+static bool delayed_write(int inumber, const char *data, int length, int offset){
 	int begin_block = offset / DISK_BLOCK_SIZE;
-	int begin_byte = offset % DISK_BLOCK_SIZE;
+	int end_block = (offset + length - 1) / DISK_BLOCK_SIZE;
+
+	std::unique_lock<std::mutex> lock(delayed_lock);
+	auto it = delayed.find(inumber);
+	int first, nblocks = 0;
+	if(it != delayed.end()){
+		first = it->second.first;
+		nblocks = it->second.data.size() / DISK_BLOCK_SIZE;
+		if(begin_block < first || begin_block > first + nblocks)
+			return false;
+	} else {
+		first = (get_inode(inumber).size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+		if(begin_block != first)
+			return false;
+	}
 
-	Debug<READ_TRAIT>::msg("fs_read: begin block = " + std::to_string(begin_block));
-	Debug<READ_TRAIT>::msg("fs_read: begin byte = " + std::to_string(begin_byte));
-	int length_read, cursor = 0, size_left = inode.inode[inode_index].size - offset;
-	Debug<READ_TRAIT>::msg("fs_read: reading from directs");
-	//comecando a leitura dos blocos diretos
-	for(int i = begin_block; i < POINTERS_PER_INODE; i++) {
-		length_read = length - begin_byte;
-		if (length_read > DISK_BLOCK_SIZE){
-			length_read = DISK_BLOCK_SIZE - begin_byte;
-		}
-
-		if(length_read > size_left){
-			Debug<READ_TRAIT>::msg("fs_read: trying to read " + std::to_string(length_read) + " but size_left is " + std::to_string(size_left) + " bytes!");
-			length_read = size_left;
-		}
-		length -= length_read;
-		size_left -= length_read;
-		Debug<READ_TRAIT>::msg("fs_read: reading " + std::to_string(length_read) + " bytes, remaining " + std::to_string(length) + " bytes!");
-		#if READ_TRAIT == 1
-			if(length < 0){
-				std::cout << std::endl;
-				Debug<READ_TRAIT>::msg("fs_read: length < 0");
-			}
-			if(size_left < 0){
-				std::cout << std::endl;
-				Debug<READ_TRAIT>::msg("fs_read: size_left < 0");
-			}
-		#endif
-
-		if(inode.inode[inode_index].direct[i] == 0) break;
-		disk_read(inode.inode[inode_index].direct[i],data_block.data);
-		std::memcpy(&data[cursor],&data_block.data[begin_byte],length_read);
-		begin_byte = 0;
-		cursor += length_read;
-		begin_block++;
-		if(length == 0 || size_left == 0) break;
-	}
-	Debug<READ_TRAIT>::msg("fs_read: finished reading from directs");
-	//comecando a leitura dos blocos diretos, caso haja
-
-	if(length > 0 && inode.inode[inode_index].indirect != 0) {
-		Debug<READ_TRAIT>::msg("fs_read: reading from indirects");
-		union fs_block indirect;
-		disk_read(inode.inode[inode_index].indirect, indirect.data);
-		for(int i = begin_block - POINTERS_PER_INODE; i < POINTERS_PER_BLOCK; i++) {
-			length_read = length - begin_byte;
-			if (length_read > DISK_BLOCK_SIZE){
-				length_read = DISK_BLOCK_SIZE - begin_byte;
-			}
-			if(length_read > size_left){
-				Debug<READ_TRAIT>::msg("fs_read: trying to read " + std::to_string(length_read) + " but size_left is " + std::to_string(size_left) + " bytes!");
-				length_read = size_left;
-			}
-			length -= length_read;
-			size_left -= length_read;
-			Debug<READ_TRAIT>::msg("fs_read: reading " + std::to_string(length_read) + " bytes, remaining " + std::to_string(length) + " bytes!");
-			#if READ_TRAIT == 1
-				if(length < 0){
-					std::cout << std::endl;
-					Debug<READ_TRAIT>::msg("fs_read: length < 0");
-				}
-				if(size_left < 0){
-					std::cout << std::endl;
-					Debug<READ_TRAIT>::msg("fs_read: size_left < 0");
-				}
-			#endif
+	int added = std::max(0, end_block - first + 1 - nblocks);
+	if(nblocks + added > DELAYED_FILE_BLOCKS)
+		return false;
+	int slot, level, index;
+	if(!extents_format() && !pointer_position(end_block, slot, level, index))
+		return false;
+	if(delayed_blocks + added > DELAYED_MAX_BLOCKS){
+		lock.unlock();
+		delayed_flush_others(inumber);
+		lock.lock();
+		if(delayed_blocks + added > DELAYED_MAX_BLOCKS)
+			return false;
+	}
+	int need = delayed_need(delayed_blocks + added);
+	lock.unlock();
+	if(need > free_blocks())
+		return false;
+	lock.lock();
+
+	//so este inodo mexe no proprio buffer, entao first e nblocks continuam valendo
+	struct delayed_file &pending = delayed[inumber];
+	pending.first = first;
+	pending.data.resize((nblocks + added) * DISK_BLOCK_SIZE, 0);
+	std::memcpy(&pending.data[offset - first * DISK_BLOCK_SIZE], data, length);
+	delayed_blocks += added;
+	return true;
+}
 
-			if(indirect.pointers[i] == 0) break;
-			disk_read(indirect.pointers[i],data_block.data);
-			std::memcpy(&data[cursor],&data_block.data[begin_byte],length_read);
-			begin_byte = 0;
-			cursor += length_read;
-			if(length == 0 || size_left == 0) break;
-		}
-		Debug<READ_TRAIT>::msg("fs_read: finished reading from indirects");
+/*
+Cursor da desfragmentacao incremental (fs_defrag_step). A parte nao usada do
+trecho reservado para o arquivo do cursor fica marcada no bitmap so na
+memoria: fs_sync() a desmarca enquanto grava os bitmaps.
+*/
+struct defrag_cursor {
+	int inumber;	//arquivo sendo desfragmentado, ou o proximo a olhar
+	int dest;	//inicio do trecho reservado para ele, 0 se nenhum
+	int length;	//tamanho do trecho reservado
+	int placed;	//blocos ja copiados para o trecho
+};
 
+struct defrag_cursor cursor = {1, 0, 0, 0};
+
+//marca ou desmarca no bitmap a parte da reserva que ainda nao foi usada
+static void defrag_reserve(bool reserve){
+	for(int b = cursor.dest + cursor.placed; cursor.dest != 0 && b < cursor.dest + cursor.length; b++){
+		if(reserve)
+			data_bitmap.set(b);
+		else
+			data_bitmap.clear(b);
 	}
+}
 
-	Debug<READ_TRAIT>::msg("fs_read: ### END ###");
-	return cursor;
+//devolve a reserva e volta o cursor para o comeco
+static void defrag_reset(){
+	defrag_reserve(false);
+	cursor = defrag_cursor{1, 0, 0, 0};
 }
 
-int search_freeblock(){
-	for(int i = 0; i < data_bitmap.size(); i++){
-		if(data_bitmap[i] == 0) {
-			data_bitmap[i] = 1;
-			return i;
-		}
+//confere so se o inumber esta dentro da tabela, para pegar o lock do inodo
+static bool check_range(int inumber){
+	if(inumber <= 0 || inumber >= superblock.ninodes){
+		std::cout << "[ERROR] inumber out of bounds!" << std::endl;
+		return false;
 	}
-	return -1;
+	return true;
 }
 
-void update_size(int inumber,int offset, int length){
-	union fs_block inode;
-	disk_read(inumber/INODES_PER_BLOCK + 1, inode.data);
-	int inode_index = inumber % INODES_PER_BLOCK;
-
-	int sizelimit_block = inode.inode[inode_index].size / DISK_BLOCK_SIZE;
-	int sizelimit_byte = inode.inode[inode_index].size % DISK_BLOCK_SIZE;
-
-	int end_block = (offset + length) / DISK_BLOCK_SIZE;
-	int end_byte = (offset + length) % DISK_BLOCK_SIZE;
-
-	if(sizelimit_block == end_block){
-		if(sizelimit_byte < end_byte){
-			inode.inode[inode_index].size += end_byte - sizelimit_byte;
-			Debug<WRITE_TRAIT>::msg("update_size: equal block inserting = " + std::to_string(end_byte - sizelimit_byte));
-			disk_write(inumber/INODES_PER_BLOCK + 1, inode.data);
-		}
-	} else if(sizelimit_block < end_block){
-		inode.inode[inode_index].size += (end_block - sizelimit_block) * DISK_BLOCK_SIZE + (end_byte - sizelimit_byte);
-		Debug<WRITE_TRAIT>::msg("update_size: end block greater inserting = " + std::to_string((end_block - sizelimit_block) * DISK_BLOCK_SIZE + (end_byte - sizelimit_byte)));
-		disk_write(inumber/INODES_PER_BLOCK + 1, inode.data);
+//confere se o inumber eh de um inodo valido, sem acessar o disco
+static bool check_inumber(int inumber){
+	if(!check_range(inumber))
+		return false;
+	std::lock_guard<std::mutex> lock(alloc_lock);
+	if(inode_bitmap[inumber] == 0){
+		std::cout << "[ERROR] inode is not valid!" << std::endl;
+		return false;
 	}
+	return true;
 }
 
-int fs_write( int inumber, const char *data, int length, int offset )
+int fs_sync()
 {
-	Debug<WRITE_TRAIT>::msg("fs_write: ### BEGIN ###");
+	std::unique_lock<std::shared_timed_mutex> guard(fs_lock);
+	if(MOUNTED) {
+		delayed_flush_all();
+		flush_inode_table();
+		if(superblock.features & FS_FEATURE_BITMAPS) {
+			defrag_reserve(false);
+			write_bitmap(inode_bitmap, inode_bitmap_start(superblock), superblock.ninodebitmapblocks, false);
+			write_bitmap(data_bitmap, data_bitmap_start(superblock), superblock.ndatabitmapblocks, false);
+			defrag_reserve(true);
+			//o superbloco limpo so pode chegar no disco depois do resto
+			cache_sync();
+			if(superblock.state != FS_STATE_CLEAN) {
+				superblock.state = FS_STATE_CLEAN;
+				write_superblock();
+			}
+		}
+	}
+	cache_sync();
+	return 1;
+}
+
+int fs_format( int flags )
+{
+	fs_defrag_stop();
+	std::unique_lock<std::shared_timed_mutex> guard(fs_lock);
+	Debug<FORMAT_TRAIT>::msg("fs_format: ### BEGIN ###");
+	if(MOUNTED){
+		std::cout << "[ERROR] can't format, already mounted!" << std::endl;
+		return 0;
+	}
+
+	union fs_block block;
+	for(int i = 0; i < DISK_BLOCK_SIZE; i++){ 	//criando um bloco vazio, para utilizar no block.data
+		block.data[i] = 0;
+	}
+
+	//o superbloco novo ja guarda onde ficam os bitmaps
+	struct fs_superblock super;
+	std::memset(&super, 0, sizeof(super));
+	super.magic = FS_MAGIC;
+	super.nblocks = disk_size();
+	super.ninodeblocks = std::ceil(disk_size()/10.0);
+	super.ninodes = super.ninodeblocks * INODES_PER_BLOCK;
+	super.features = FS_FEATURE_BITMAPS;
+	if(flags & FS_FORMAT_EXTENTS)
+		super.features |= FS_FEATURE_EXTENTS;
+	else
+		super.features |= FS_FEATURE_DEEP;
+	super.state = FS_STATE_CLEAN;
+	super.ninodebitmapblocks = (super.ninodes + BITMAP_BITS_PER_BLOCK - 1) / BITMAP_BITS_PER_BLOCK;
+	super.ndatabitmapblocks = (super.nblocks + BITMAP_BITS_PER_BLOCK - 1) / BITMAP_BITS_PER_BLOCK;
+	if(data_start(super) >= disk_size()){
+		std::cout << "[ERROR] disk too small to format" << std::endl;
+		return 0;
+	}
+	int first_data = data_start(super);
+
+	if(flags & FS_FORMAT_FAST) {
+		//so a tabela de inodos precisa ser zerada de fato; a area de dados eh
+		//descartada, e blocos descartados sao lidos como zero
+		std::vector<int> blocks;
+		for(int i = 1; i <= super.ninodeblocks && i < disk_size(); i++)
+			blocks.push_back(i);
+		std::vector<char> zeros(blocks.size() * DISK_BLOCK_SIZE, 0);
+		cache_write_blocks(blocks.data(), blocks.size(), zeros.data());
+		cache_discard(first_data, disk_size() - first_data);
+		disk_discard(first_data, disk_size() - first_data);
+	} else {
+		for(int i = 0 ; i < disk_size(); i++) { //limpando o disco
+			cache_write(i,block.data);
+		}
+	}
+
+	Debug<FORMAT_TRAIT>::msg("fs_format: disk cleaned");
+	//bitmaps iniciais: so os metadados ocupados
+	inode_bitmap.assign(super.ninodes, 0);
+	data_bitmap.assign(super.nblocks, 0);
+	for(int i = 0; i < first_data; i++)
+		data_bitmap.set(i);
+	write_bitmap(inode_bitmap, inode_bitmap_start(super), super.ninodebitmapblocks, true);
+	write_bitmap(data_bitmap, data_bitmap_start(super), super.ndatabitmapblocks, true);
+
+	//criando o superbloco
+	block.super = super;
+	cache_write(0,block.data);
+	for(int i = 0; i < disk_size(); i++)
+		disk_classify(i, DISK_CLASS_DATA);
+	disk_classify(0, DISK_CLASS_SUPER);
+	for(int i = 0; i < block.super.ninodeblocks; i++)
+		disk_classify(i+1, DISK_CLASS_INODE);
+	for(int i = inode_bitmap_start(super); i < first_data; i++)
+		disk_classify(i, DISK_CLASS_BITMAP);
+	Debug<FORMAT_TRAIT>::msg("fs_format: ### END ###");
+	return 1;
+}
+
+/*
+Varredura paralela da tabela de inodos, usada pelo mount (quando os bitmaps
+do disco nao servem) e pelo debug. Os blocos de inodos sao divididos em
+intervalos continuos, um por thread. A tabela ja esta na memoria; so os
+blocos indiretos sao lidos, pelo cache, que atende as threads em paralelo.
+*/
+const int SCAN_MIN_INODE_BLOCKS = 4;	//menos que isso por thread nao compensa criar a thread
+
+static int scan_threads(int ninodeblocks){
+	int n = std::thread::hardware_concurrency();
+	return std::max(1, std::min(n, ninodeblocks / SCAN_MIN_INODE_BLOCKS));
+}
+
+//chama work(thread, begin, end) para cada intervalo de blocos de inodos
+template<class F>
+static void parallel_scan(int ninodeblocks, int nthreads, F work){
+	std::vector<std::thread> threads;
+	for(int t = 0; t < nthreads - 1; t++)
+		threads.emplace_back(work, t, (long)ninodeblocks * t / nthreads, (long)ninodeblocks * (t + 1) / nthreads);
+	work(nthreads - 1, (long)ninodeblocks * (nthreads - 1) / nthreads, ninodeblocks);
+	for(auto &thread : threads)
+		thread.join();
+}
+
+//le de uma vez os blocos do topo das arvores (indiretos ou de extents) dos inodos validos de um bloco de inodos
+static void scan_read_indirects(const union fs_block &iblock, std::vector<union fs_block> &indirects){
+	std::vector<int> blocks;
+	for(int j = 0; j < INODES_PER_BLOCK; j++){
+		const struct fs_inode &inode = iblock.inode[j];
+		if(inode.isvalid != 1)
+			continue;
+		if(extents_format()){
+			if(inode.extentblock != 0)
+				blocks.push_back(inode.extentblock);
+		} else {
+			for(int p = direct_pointers(); p < direct_pointers() + indirect_levels(); p++)
+				if(inode.pointers[p] != 0)
+					blocks.push_back(inode.pointers[p]);
+		}
+	}
+	indirects.resize(blocks.size());
+	if(blocks.empty())
+		return;
+	cache_read_blocks(blocks.data(), blocks.size(), indirects[0].data);
+}
+
+static void scan_read(int blocknum, union fs_block &block){
+	cache_read(blocknum, block.data);
+}
+
+//visita em ordem os blocos abaixo de um indireto de nivel level ja lido: visit(bloco, nivel), nivel 0 para dados
+template<class F>
+static void scan_tree(const union fs_block &node, int level, F &visit){
+	for(int p = 0; p < POINTERS_PER_BLOCK; p++){
+		int b = node.pointers[p];
+		if(b == 0)
+			continue;
+		visit(b, level - 1);
+		if(level > 1){
+			union fs_block child;
+			scan_read(b, child);
+			scan_tree(child, level - 1, visit);
+		}
+	}
+}
+
+void fs_debug()
+{
+	std::unique_lock<std::shared_timed_mutex> guard(fs_lock);
+	Debug<DEBUG_TRAIT>::msg("fs_debug: ### BEGIN ###");
+
+	if(!MOUNTED) {
+		std::cout << "[ERROR] please mount first!" << std::endl;
+		return;
+	}
+
+	//os blocos ainda sem lugar no disco nao apareceriam na listagem
+	delayed_flush_all();
+
+	union fs_block block;
+
+	block.super = superblock;
+
+	if(block.super.magic != FS_MAGIC){
+		std::cout << "magic number is invalid" << std::endl;
+		return;
+	}
+
+	std::cout << "magic number is valid!" << std::endl;
+	std::cout << "superblock:" << std::endl;
+	std::cout << "\t" << block.super.nblocks << " blocks" << std::endl;
+	std::cout << "\t" << block.super.ninodeblocks << " inode blocks" << std::endl;
+	std::cout << "\t" << block.super.ninodes << " inodes" << std::endl;
+	if(block.super.features & FS_FEATURE_EXTENTS)
+		std::cout << "\textent inodes" << std::endl;
+	if(block.super.features & FS_FEATURE_DEEP)
+		std::cout << "\tdouble and triple indirect inodes" << std::endl;
+	if(block.super.features & FS_FEATURE_BITMAPS)
+		std::cout << "\t" << block.super.ninodebitmapblocks + block.super.ndatabitmapblocks << " bitmap blocks" << std::endl;
+	//conta como usados os indiretos de todos os niveis, duplos e triplos inclusive
+	std::cout << "\t" << data_bitmap.free_count() << " free blocks" << std::endl;
+
+	//cada bloco de inodos vira um texto, montado em paralelo e impresso em ordem
+	int nthreads = scan_threads(block.super.ninodeblocks);
+	std::vector<std::string> output(block.super.ninodeblocks);
+
+	parallel_scan(block.super.ninodeblocks, nthreads, [&](int t, int begin, int end){
+		std::vector<union fs_block> indirects;
+		for(int b = begin; b < end; b++){
+			const union fs_block &iblock = inode_table[b];
+			scan_read_indirects(iblock, indirects);
+			std::ostringstream out;
+			int k = 0;
+			for(int j = 0; j < INODES_PER_BLOCK; j++){
+				const struct fs_inode &inode = iblock.inode[j];
+				if(inode.isvalid != 1)
+					continue;
+				out << "inode " << b*INODES_PER_BLOCK + j << ":" << std::endl;
+				out << "\tsize: " << inode.size <<  " bytes";
+
+				if(extents_format()){
+					std::vector<struct fs_extent> extents;
+					inode_extents(inode, inode.extentblock != 0 ? &indirects[k++] : NULL, extents);
+					if(!extents.empty()){
+						out << std::endl << "\textents: ";
+						for(auto &e : extents)
+							out << e.start << "+" << e.length << " ";
+					}
+					if(inode.extentblock != 0)
+						out << std::endl << "\textent block: " << inode.extentblock;
+					out << std::endl;
+					continue;
+				}
+
+				bool have_direct = false;
+
+				for(int p = 0 ; p < direct_pointers(); p++){
+					if(inode.pointers[p] != 0){
+						if(!have_direct){out << std::endl << "\tdirect blocks: "; have_direct = true;}
+						out << inode.pointers[p] << " ";
+					}
+				}
+
+				for(int level = 1; level <= indirect_levels(); level++){
+					int top = inode.pointers[direct_pointers() + level - 1];
+					if(top == 0)
+						continue;
+					const char *name = level == 1 ? "indirect" : level == 2 ? "double indirect" : "triple indirect";
+					out << std::endl << "\t" << name << " block: " << top << std::endl;
+
+					std::vector<int> data, inner;
+					auto visit = [&](int b, int l){ (l == 0 ? data : inner).push_back(b); };
+					scan_tree(indirects[k++], level, visit);
+					if(!inner.empty()){
+						out << "\t" << name << " pointer blocks: ";
+						for(int b : inner)
+							out << b << " ";
+						out << std::endl;
+					}
+					out << "\t" << name << " data blocks: ";
+					for(int b : data)
+						out << b << " ";
+				}
+				out << std::endl;
+			}
+			output[b] = out.str();
+		}
+	});
+
+	for(auto &text : output)
+		std::cout << text;
+
+	Debug<DEBUG_TRAIT>::msg("fs_debug: ### END ###");
+}
+
+//refaz os bitmaps a partir da tabela de inodos e dos blocos indiretos
+static void scan_bitmaps(const union fs_block &block){
+	Debug<MOUNT_TRAIT>::msg("fs_mount: CONSTRUCTING INODE BITMAP");
+
+	for(int i = 0 ; i < block.super.ninodes ; i++){
+		if(get_inode(i).isvalid == 1){
+			inode_bitmap.set(i);
+			Debug<MOUNT_TRAIT>::msg("fs_mount: inode " + std::to_string(i) + " valid!");
+		}
+		else
+			inode_bitmap.clear(i);
+	}
+
+	Debug<MOUNT_TRAIT>::msg("fs_mount: CONSTRUCTING DATA BITMAP");
+
+	//cada thread monta um bitmap parcial, juntados no fim
+	int nthreads = scan_threads(block.super.ninodeblocks);
+	std::vector<bitmap> partial(nthreads);
+	std::vector<std::vector<int>> indirect_blocks(nthreads);
+
+	parallel_scan(block.super.ninodeblocks, nthreads, [&](int t, int begin, int end){
+		partial[t].assign(block.super.nblocks, 0);
+		std::vector<union fs_block> indirects;
+		for(int i = begin; i < end; i++){
+			const union fs_block &iblock = inode_table[i];
+			scan_read_indirects(iblock, indirects);
+			int k = 0;
+			for(int j = 0; j < INODES_PER_BLOCK; j++){
+				const struct fs_inode &inode = iblock.inode[j];
+				if(inode.isvalid != 1)
+					continue;
+				if(extents_format()){
+					if(inode.extentblock != 0){
+						partial[t].set(inode.extentblock);
+						indirect_blocks[t].push_back(inode.extentblock);
+					}
+					std::vector<struct fs_extent> extents;
+					inode_extents(inode, inode.extentblock != 0 ? &indirects[k++] : NULL, extents);
+					for(auto &e : extents)
+						for(int p = 0; p < e.length; p++)
+							partial[t].set(e.start + p);
+					continue;
+				}
+				for(int p = 0 ; p < direct_pointers(); p++)
+					if(inode.pointers[p] != 0)
+						partial[t].set(inode.pointers[p]);
+				for(int level = 1; level <= indirect_levels(); level++){
+					int top = inode.pointers[direct_pointers() + level - 1];
+					if(top == 0)
+						continue;
+					partial[t].set(top);
+					indirect_blocks[t].push_back(top);
+					auto visit = [&](int b, int l){
+						partial[t].set(b);
+						if(l > 0)
+							indirect_blocks[t].push_back(b);
+					};
+					scan_tree(indirects[k++], level, visit);
+				}
+			}
+		}
+	});
+
+	for(int t = 0; t < nthreads; t++){
+		data_bitmap.merge(partial[t]);
+		for(int b : indirect_blocks[t])
+			disk_classify(b, DISK_CLASS_INDIRECT);
+	}
+
+	Debug<MOUNT_TRAIT>::msg("fs_mount: FILLING DATA BITMAP WITH INODES AND SUPER BLOCKS");
+	for(int i = 0; i < data_start(block.super); i++)
+		data_bitmap.set(i);
+}
+
+/*
+Arquivos abertos. Um handle guarda o inumber e o mapa plano bloco logico ->
+bloco fisico do arquivo, montado na abertura ate o tamanho e estendido quando
+um acesso passa do fim dele. Alocar blocos novos nao muda os que ja estao no
+mapa; so liberar ou mover (fs_delete, desfragmentacao) muda a versao do layout
+do inodo, e o mapa eh refeito no proximo acesso. Com o mapa em dia fs_pread e
+fs_pwrite nao leem nenhum indireto, so os dados. Leituras paralelas pelo
+mesmo handle estendem o mapa uma de cada vez, sob o lock do handle.
+*/
+struct fs_handle {
+	int inumber;			//0 se o handle esta livre
+	int version;			//versao do layout quando o mapa foi montado
+	std::vector<int> blocks;	//bloco fisico de cada bloco logico, ate o primeiro buraco
+	std::mutex lock;		//o mapa
+};
+
+std::deque<struct fs_handle> handles;	//um handle nunca muda de endereco
+std::vector<int> layout_version;	//por inodo
+
+//os blocos do inodo (ou de todos, com -1) foram liberados ou movidos
+static void layout_changed(int inumber){
+	if(inumber < 0){
+		for(auto &v : layout_version)
+			v++;
+	} else {
+		layout_version[inumber]++;
+	}
+}
+
+static void handle_free(struct fs_handle &handle){
+	std::lock_guard<std::mutex> lock(handle.lock);
+	handle.inumber = 0;
+	handle.blocks.clear();
+}
+
+//um arquivo apagado fecha os handles abertos nele
+static void handles_forget(int inumber){
+	std::lock_guard<std::mutex> lock(handles_lock);
+	for(auto &h : handles)
+		if(h.inumber == inumber)
+			handle_free(h);
+}
+
+//blocos fisicos de begin_block a end_block, lidos dos ponteiros ou extents do inodo
+static void lookup_blocks(int inumber, int begin_block, int end_block, std::vector<int> &blocks){
+	if(extents_format()){
+		std::vector<struct fs_extent> extents;
+		load_extents(get_inode(inumber), extents);
+		extent_blocks(extents, begin_block, end_block, blocks);
+	} else {
+		pointer_blocks(inumber, begin_block, end_block, blocks);
+	}
+}
+
+static void handle_map(struct fs_handle &handle){
+	int nblocks = (get_inode(handle.inumber).size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+	handle.blocks.clear();
+	if(nblocks > 0)
+		lookup_blocks(handle.inumber, 0, nblocks - 1, handle.blocks);
+	handle.version = layout_version[handle.inumber];
+	Debug<READ_TRAIT>::msg("handle_map: inode " + std::to_string(handle.inumber) + " has " + std::to_string(handle.blocks.size()) + " mapped blocks");
+}
+
+//o handle, se fd for de um arquivo aberto; inumber recebe o arquivo dele
+static struct fs_handle *get_handle(int fd, int &inumber){
+	std::lock_guard<std::mutex> lock(handles_lock);
+	if(fd < 0 || fd >= (int)handles.size() || handles[fd].inumber == 0){
+		std::cout << "[ERROR] invalid file handle" << std::endl;
+		return NULL;
+	}
+	inumber = handles[fd].inumber;
+	return &handles[fd];
+}
+
+//depois de pegar o lock do inodo: o handle continua aberto no mesmo arquivo?
+static bool check_handle(struct fs_handle *handle, int inumber){
+	std::lock_guard<std::mutex> lock(handles_lock);
+	if(handle->inumber != inumber){
+		std::cout << "[ERROR] invalid file handle" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+//blocos fisicos de begin_block a end_block, pelo mapa do handle quando houver
+static void file_blocks(int inumber, int begin_block, int end_block, std::vector<int> &blocks, struct fs_handle *handle){
+	if(!handle){
+		lookup_blocks(inumber, begin_block, end_block, blocks);
+		return;
+	}
+	std::lock_guard<std::mutex> lock(handle->lock);
+	if(handle->version != layout_version[inumber])
+		handle_map(*handle);
+	if(end_block >= (int)handle->blocks.size())
+		lookup_blocks(inumber, handle->blocks.size(), end_block, handle->blocks);
+	for(int b = begin_block; b <= end_block && b < (int)handle->blocks.size(); b++)
+		blocks.push_back(handle->blocks[b]);
+}
+
+/*
+Leitura antecipada. Cada inodo tem um fluxo: o bloco onde a ultima leitura
+parou, a janela e ate onde ja foi pedido. Leituras que continuam o fluxo
+mantem pedidos ate uma janela a frente, em lotes assincronos (cache_prefetch)
+que saem quando falta menos de meia janela; cada lote novo dobra a janela ate
+READAHEAD_MAX. Uma leitura fora de ordem corta a janela pela metade. O fluxo
+fica sob o lock de stream do inodo, ja que leitores do mesmo arquivo andam
+juntos.
+*/
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 64
+
+struct fs_stream {
+	int next;	//bloco logico seguinte ao fim da ultima leitura
+	int window;	//blocos a manter pedidos a frente, 0 se o acesso parece aleatorio
+	int ahead;	//primeiro bloco logico ainda nao pedido
+};
+
+std::vector<struct fs_stream> streams;
+
+int fs_mount()
+{
+	fs_defrag_stop();
+	std::unique_lock<std::shared_timed_mutex> guard(fs_lock);
+	Debug<MOUNT_TRAIT>::msg("fs_mount: ### BEGIN ###");
+	//remontar leria de novo a tabela de inodos e perderia o que ainda esta so na memoria
+	if(MOUNTED){
+		std::cout << "[ERROR] already mounted!" << std::endl;
+		return 0;
+	}
+	union fs_block block;
+
+	cache_read(0,block.data);
+
+	if(block.super.magic != FS_MAGIC){
+		Debug<MOUNT_TRAIT>::msg("fs_mount: magic number invalid");
+		return 0;
+	}
+
+	Debug<MOUNT_TRAIT>::msg("fs_mount: magic number valid");
+
+	data_bitmap.assign(block.super.nblocks, 0);
+	inode_bitmap.assign(block.super.ninodes, 0);
+	delayed.clear();
+	delayed_blocks = 0;
+	owners_built = false;
+	handles.clear();
+	layout_version.assign(block.super.ninodes, 0);
+	std::vector<struct fs_inode_lock>(block.super.ninodes).swap(inode_locks);
+	streams.assign(block.super.ninodes, fs_stream{0, 0, 0});
+	cursor = defrag_cursor{1, 0, 0, 0};
+
+	Debug<MOUNT_TRAIT>::msg("fs_mount: LOADING INODE TABLE");
+	superblock = block.super;
+	inode_table.resize(block.super.ninodeblocks);
+	inode_table_dirty.assign(block.super.ninodeblocks, false);
+	inode_table_ndirty = 0;
+	std::vector<int> inode_blocks;
+	for(int i = 0; i < block.super.ninodeblocks; i++)
+		inode_blocks.push_back(i + 1);
+	cache_read_blocks(inode_blocks.data(), inode_blocks.size(), inode_table[0].data);
+	inode_disk = inode_table;
+
+	disk_classify(0, DISK_CLASS_SUPER);
+	for(int i = 0; i < block.super.ninodeblocks; i++)
+		disk_classify(i+1, DISK_CLASS_INODE);
+
+	for(int i = inode_bitmap_start(block.super); i < data_start(block.super); i++)
+		disk_classify(i, DISK_CLASS_BITMAP);
+
+	if((block.super.features & FS_FEATURE_BITMAPS) && block.super.state == FS_STATE_CLEAN){
+		Debug<MOUNT_TRAIT>::msg("fs_mount: LOADING BITMAPS");
+		read_bitmap(inode_bitmap, block.super.ninodes, inode_bitmap_start(block.super), block.super.ninodebitmapblocks);
+		read_bitmap(data_bitmap, block.super.nblocks, data_bitmap_start(block.super), block.super.ndatabitmapblocks);
+	} else {
+		//imagem antiga, ou nao foi desmontada direito; com bitmaps no disco
+		//eles sao regravados inteiros, e o estado fica sujo ate o fs_sync
+		scan_bitmaps(block);
+		inode_bitmap.clean();
+		data_bitmap.clean();
+		if(block.super.features & FS_FEATURE_BITMAPS){
+			write_bitmap(inode_bitmap, inode_bitmap_start(block.super), block.super.ninodebitmapblocks, true);
+			write_bitmap(data_bitmap, data_bitmap_start(block.super), block.super.ndatabitmapblocks, true);
+		}
+	}
+
+	MOUNTED = true;
+
+	#if MOUNT_TRAIT == 1
+		for(int i = 0; i < data_bitmap.size(); i++)
+			std::cout << data_bitmap[i];
+		std::cout << " --> data_bitmap" << std::endl;
+		for(int i = 0; i < inode_bitmap.size(); i++)
+			std::cout << inode_bitmap[i];
+		std::cout << " --> inode_bitmap" << std::endl;
+	#endif
+
+	Debug<MOUNT_TRAIT>::msg("fs_mount: ### END ###");
+	return 1;
+}
+
+int fs_create()
+{
+	std::shared_lock<std::shared_timed_mutex> guard(fs_lock);
+	if(!MOUNTED) {
+		std::cout << "[ERROR] please mount first!" << std::endl;
+		return 0;
+	}
+	fs_modified();
+	int i;
+	{
+		std::lock_guard<std::mutex> lock(alloc_lock);
+		i = inode_bitmap.alloc(1);	//começa em 1 pq o inode 0 eh invalido
+	}
+	if(i > 0) {
+		inode_write_lock inode_lock(i);
+		struct fs_inode &inode = get_inode(i);	// o inodo na copia da tabela, gravada depois em lote
+		inode.isvalid = 1;
+		inode.size = 0;
+		for(int j = 0; j < POINTERS_PER_INODE + 1; j++)
+			inode.pointers[j] = 0;
+		leaf_cache_forget(i);
+		streams[i] = fs_stream{0, 0, 0};
+		mark_inode(i);
+		return i;
+	}
+	std::cout << "[ERROR] no available inode" << std::endl;
+	return 0;
+}
+
+//devolve o inodo ao bitmap
+static void free_inode(int inumber){
+	std::lock_guard<std::mutex> lock(alloc_lock);
+	inode_bitmap.clear(inumber);
+}
+
+int fs_delete( int inumber )
+{
+	std::shared_lock<std::shared_timed_mutex> guard(fs_lock);
+
+	Debug<DELETE_TRAIT>::msg("fs_delete: ### BEGIN ###");
+	if(!MOUNTED) {
+		std::cout << "[ERROR] please mount first!" << std::endl;
+		return 0;
+	}
+	Debug<DELETE_TRAIT>::msg("fs_delete: checking inumber value");
+	if(!check_range(inumber))
+		return 0;
+	inode_write_lock inode_lock(inumber);
+	if(!check_inumber(inumber))
+		return 0;
+	fs_modified();
+	delayed_forget(inumber);
+	handles_forget(inumber);
+	struct fs_inode &inode = get_inode(inumber);
+	union fs_block data;
+	for(int i = 0; i < DISK_BLOCK_SIZE; i++){ 	//criando um bloco vazio, para utilizar no block.data
+		data.data[i] = 0;
+	}
+
+	inode.isvalid = 0;		//comecando a deletar e liberar os blocos
+	inode.size = 0;
+	if(extents_format()){
+		//cada extent eh descartado de uma vez; blocos descartados sao lidos como zero
+		std::vector<struct fs_extent> extents;
+		load_extents(inode, extents);
+		for(auto &e : extents){
+			Debug<DELETE_TRAIT>::msg("fs_delete: found extent " + std::to_string(e.start) + "+" + std::to_string(e.length));
+			cache_discard(e.start, e.length);
+			disk_discard(e.start, e.length);
+			for(int i = 0; i < e.length; i++){
+				free_block(e.start + i);
+				owner_clear(e.start + i);
+			}
+		}
+		if(inode.extentblock != 0){
+			cache_write(inode.extentblock, data.data);
+			free_block(inode.extentblock);
+			owner_clear(inode.extentblock);
+			disk_classify(inode.extentblock, DISK_CLASS_DATA);
+		}
+		for(int i = 0; i < EXTENTS_PER_INODE; i++)
+			inode.extents[i] = fs_extent{0, 0};
+		inode.extentblock = 0;
+		inode.nextents = 0;
+		free_inode(inumber);
+		mark_inode(inumber);
+		Debug<DELETE_TRAIT>::msg("fs_delete: ### END ###");
+		return 1;
+	}
+	Debug<DELETE_TRAIT>::msg("fs_delete: cleaning pointers");
+	for(int p = 0; p < direct_pointers() + indirect_levels(); p++){	//limpando os ponteiros e os blocos abaixo deles
+		if(inode.pointers[p] != 0){
+			free_tree(inode.pointers[p], pointer_level(p), data);
+			inode.pointers[p] = 0;
+		}
+	}
+	leaf_cache_forget(inumber);
+
+	free_inode(inumber);
+	mark_inode(inumber);
+	Debug<DELETE_TRAIT>::msg("fs_delete: ### END ###");
+	return 1;
+}
+
+int fs_getsize( int inumber )
+{
+	std::shared_lock<std::shared_timed_mutex> guard(fs_lock);
+
+	Debug<GETSIZE_TRAIT>::msg("fs_getsize: ### BEGIN ###");
+
+ 	if(!MOUNTED) {
+ 		std::cout << "[ERROR] please mount first!" << std::endl;
+ 		return -1;
+ 	}
+
+	//o tamanho eh o que foi escrito; blocos reservados por fs_fallocate nao contam
+	if(inumber >= 0 && inumber < superblock.ninodes){
+		std::shared_lock<std::shared_timed_mutex> inode_lock(inode_locks[inumber].rw);
+		std::unique_lock<std::mutex> lock(alloc_lock);
+		bool valid = inode_bitmap[inumber] != 0;
+		lock.unlock();
+		if(valid)
+			return get_inode(inumber).size;
+	}
+
+	Debug<GETSIZE_TRAIT>::msg("fs_getsize: ### END ###");
+
+ 	return -1;
+}
+
+static void readahead(int inumber, int begin_block, int end_block, struct fs_handle *handle){
+	//sem cache nao ha onde guardar os blocos antecipados
+	if(cache_buffers() == 0)
+		return;
+	std::lock_guard<std::mutex> lock(inode_locks[inumber].stream);
+	struct fs_stream &stream = streams[inumber];
+	bool sequential = begin_block == stream.next || begin_block == stream.next - 1;
+	stream.next = end_block + 1;
+	if(!sequential){
+		stream.window /= 2;
+		stream.ahead = stream.next;
+		return;
+	}
+	if(stream.ahead < stream.next)
+		stream.ahead = stream.next;
+	if(stream.window > 0 && stream.ahead - stream.next >= stream.window / 2)
+		return;
+	stream.window = stream.window == 0 ? READAHEAD_MIN : std::min(stream.window * 2, READAHEAD_MAX);
+
+	//nao passa do fim do arquivo nem entra no que so existe no buffer da alocacao atrasada
+	int last = (get_inode(inumber).size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE - 1;
+	int pending = delayed_first(inumber);
+	if(pending >= 0)
+		last = std::min(last, pending - 1);
+	int from = stream.ahead;
+	int to = std::min(stream.next + stream.window - 1, last);
+	if(from > to)
+		return;
+
+	std::vector<int> blocks;
+	file_blocks(inumber, from, to, blocks, handle);
+	if(blocks.empty()){
+		stream.ahead = to + 1;	//buraco no arquivo, nada para antecipar
+		return;
+	}
+	//o cache pode aceitar menos; o resto fica para o proximo lote
+	int accepted = cache_prefetch(blocks.data(), blocks.size());
+	stream.ahead = from + accepted;
+	Debug<READ_TRAIT>::msg("fs_read: readahead of blocks " + std::to_string(from) + "-" + std::to_string(stream.ahead - 1) + ", window " + std::to_string(stream.window));
+}
+
+/*
+Lock compartilhado do inodo para ler ate end_block. O que do trecho ainda esta
+no buffer da alocacao atrasada vai para o disco antes, com o lock exclusivo;
+como outra escrita pode encher o buffer de novo nesse meio tempo, confere de
+novo ja com o lock compartilhado.
+*/
+static std::shared_lock<std::shared_timed_mutex> lock_for_read(int inumber, int end_block){
+	while(true){
+		std::shared_lock<std::shared_timed_mutex> lock(inode_locks[inumber].rw);
+		int pending = delayed_first(inumber);
+		if(pending < 0 || end_block < pending)
+			return lock;
+		lock.unlock();
+		inode_write_lock exclusive(inumber);
+		delayed_flush(inumber);
+	}
+}
+
+//le com o lock de lock_for_read
+static int read_data( int inumber, char *data, int length, int offset, struct fs_handle *handle )
+{
+	Debug<READ_TRAIT>::msg("fs_read: begin reading data: \n\tinumber = " + std::to_string(inumber) + "\n\tlength = " + std::to_string(length) + "\n\toffset = " + std::to_string(offset));
+
+	struct fs_inode &inode = get_inode(inumber);
+
+	int size_left = inode.size - offset;
+	if(length > size_left)
+		length = size_left;
+	if(length <= 0 || offset < 0){
+		Debug<READ_TRAIT>::msg("fs_read: nothing to read");
+		return 0;
+	}
+
+	int begin_block = offset / DISK_BLOCK_SIZE;
+	int begin_byte = offset % DISK_BLOCK_SIZE;
+	int end_block = (offset + length - 1) / DISK_BLOCK_SIZE;
+
+	Debug<READ_TRAIT>::msg("fs_read: begin block = " + std::to_string(begin_block));
+	Debug<READ_TRAIT>::msg("fs_read: begin byte = " + std::to_string(begin_byte));
+
+	//monta a lista dos blocos fisicos, para pedir todos ao disco de uma vez
+	std::vector<int> blocks;
+	file_blocks(inumber, begin_block, end_block, blocks, handle);
+
+	if(blocks.empty()) return 0;
+
+	std::vector<char> buffer(blocks.size() * DISK_BLOCK_SIZE);
+	cache_read_blocks(blocks.data(), blocks.size(), buffer.data());
+	readahead(inumber, begin_block, end_block, handle);
+
+	int cursor = std::min(length, (int)blocks.size() * DISK_BLOCK_SIZE - begin_byte);
+	std::memcpy(data, &buffer[begin_byte], cursor);
+	Debug<READ_TRAIT>::msg("fs_read: read " + std::to_string(cursor) + " bytes from " + std::to_string(blocks.size()) + " blocks");
+
+	Debug<READ_TRAIT>::msg("fs_read: ### END ###");
+	return cursor;
+}
+
+int fs_read( int inumber, char *data, int length, int offset )
+{
+	std::shared_lock<std::shared_timed_mutex> guard(fs_lock);
+	Debug<READ_TRAIT>::msg("fs_read: ### BEGIN ###");
+	if(!MOUNTED) {
+		std::cout << "[ERROR] please mount first!" << std::endl;
+		return 0;
+	}
+	Debug<READ_TRAIT>::msg("fs_read: checking inumber value");
+	if(!check_range(inumber))
+		return 0;
+	auto inode_lock = lock_for_read(inumber, (offset + length - 1) / DISK_BLOCK_SIZE);
+	if(!check_inumber(inumber))
+		return 0;
+
+	return read_data(inumber, data, length, offset, NULL);
+}
+
+void update_size(int inumber,int offset, int length){
+	struct fs_inode &inode = get_inode(inumber);
+
+	int sizelimit_block = inode.size / DISK_BLOCK_SIZE;
+	int sizelimit_byte = inode.size % DISK_BLOCK_SIZE;
+
+	int end_block = (offset + length) / DISK_BLOCK_SIZE;
+	int end_byte = (offset + length) % DISK_BLOCK_SIZE;
+
+	if(sizelimit_block == end_block){
+		if(sizelimit_byte < end_byte){
+			inode.size += end_byte - sizelimit_byte;
+			Debug<WRITE_TRAIT>::msg("update_size: equal block inserting = " + std::to_string(end_byte - sizelimit_byte));
+			mark_inode(inumber);
+		}
+	} else if(sizelimit_block < end_block){
+		inode.size += (end_block - sizelimit_block) * DISK_BLOCK_SIZE + (end_byte - sizelimit_byte);
+		Debug<WRITE_TRAIT>::msg("update_size: end block greater inserting = " + std::to_string((end_block - sizelimit_block) * DISK_BLOCK_SIZE + (end_byte - sizelimit_byte)));
+		mark_inode(inumber);
+	}
+}
+
+//escreve com o lock exclusivo do inodo
+static int write_data( int inumber, const char *data, int length, int offset, struct fs_handle *handle )
+{
+	fs_modified();
+
+	Debug<WRITE_TRAIT>::msg("fs_write: begin writing data: \n\tinumber = " + std::to_string(inumber) + "\n\tlength = " + std::to_string(length) + "\n\toffset = " + std::to_string(offset));
+
+	int begin_block = offset / DISK_BLOCK_SIZE;
+	int begin_byte = offset % DISK_BLOCK_SIZE;
+	int end_block = (offset + length - 1) / DISK_BLOCK_SIZE;
+
+	Debug<WRITE_TRAIT>::msg("fs_write: begin block = " + std::to_string(begin_block));
+	Debug<WRITE_TRAIT>::msg("fs_write: begin byte = " + std::to_string(begin_byte));
+
+	//com o mapa do handle, reescrever blocos que ja existem nao passa pelo alocador
+	std::vector<int> blocks;
+	std::vector<bool> fresh;	//blocos recem alocados, que nao precisam ser lidos
+	int pending = delayed_first(inumber);
+	if(handle && (pending < 0 || end_block < pending)){
+		file_blocks(inumber, begin_block, end_block, blocks, handle);
+		if((int)blocks.size() == end_block - begin_block + 1)
+			fresh.assign(blocks.size(), false);
+		else
+			blocks.clear();
+	}
+
+	//escritas depois do fim do arquivo so ganham blocos quando o buffer for gravado
+	if(blocks.empty() && delayed_write(inumber, data, length, offset)){
+		Debug<WRITE_TRAIT>::msg("fs_write: delayed " + std::to_string(length) + " bytes");
+		update_size(inumber, offset, length);
+		return length;
+	}
+	//primeiro aloca todos os blocos, e so depois escreve os dados de uma vez
+	bool full = false, nospace = false;
+	if(blocks.empty()){
+		delayed_flush(inumber);
+		if(extents_format())
+			extent_allocate(inumber, begin_block, end_block, blocks, fresh, full, nospace);
+		else
+			pointer_allocate(inumber, begin_block, end_block, blocks, fresh, full, nospace);
+	}
+
+	if(nospace)
+		std::cout << "[ERROR] there is no free space anymore" << std::endl;
+	if(full)
+		std::cout << "[ERROR] file reached the maximum size" << std::endl;
+	if(blocks.empty())
+		return 0;
+
+	int cursor = std::min(length, (int)blocks.size() * DISK_BLOCK_SIZE - begin_byte);
+	int last = blocks.size() - 1;
+
+	//blocos escritos so em parte precisam do conteudo antigo
+	std::vector<char> buffer(blocks.size() * DISK_BLOCK_SIZE, 0);
+	if(begin_byte != 0 && !fresh[0])
+		cache_read(blocks[0], &buffer[0]);
+	if((begin_byte + cursor) % DISK_BLOCK_SIZE != 0 && !fresh[last] && (last != 0 || begin_byte == 0))
+		cache_read(blocks[last], &buffer[last * DISK_BLOCK_SIZE]);
+
+	std::memcpy(&buffer[begin_byte], data, cursor);
+	cache_write_blocks(blocks.data(), blocks.size(), buffer.data());
+	Debug<WRITE_TRAIT>::msg("fs_write: wrote " + std::to_string(cursor) + " bytes in " + std::to_string(blocks.size()) + " blocks");
+
+	Debug<WRITE_TRAIT>::msg("fs_write: ### END ###");
+	update_size(inumber,offset, cursor);
+	return cursor;
+}
+
+int fs_write( int inumber, const char *data, int length, int offset )
+{
+	std::shared_lock<std::shared_timed_mutex> guard(fs_lock);
+	Debug<WRITE_TRAIT>::msg("fs_write: ### BEGIN ###");
 	if(!MOUNTED) {
 		std::cout << "[ERROR] please mount first!" << std::endl;
 		return -1;
 	}
 	if(data == NULL){
 		std::cout << "[ERROR] invalid buffer" << std::endl;
+		return -1;
 	}
 	Debug<WRITE_TRAIT>::msg("fs_write: checking inumber value");
-	union fs_block block;
-	disk_read(0, block.data);
-	if(inumber == 0 || inumber > block.super.ninodes){
-		std::cout << "[ERROR] inumber out of bounds!" << std::endl;
+	if(!check_range(inumber))
+		return -1;
+	inode_write_lock inode_lock(inumber);
+	if(!check_inumber(inumber))
+		return -1;
+	if(length <= 0 || offset < 0)
+		return 0;
+
+	return write_data(inumber, data, length, offset, NULL);
+}
+
+int fs_open( int inumber )
+{
+	std::shared_lock<std::shared_timed_mutex> guard(fs_lock);
+	if(!MOUNTED) {
+		std::cout << "[ERROR] please mount first!" << std::endl;
 		return -1;
 	}
-	if(inode_bitmap[inumber] == 0){
-		std::cout << "[ERROR] inode is not valid!" << std::endl;
+	if(!check_range(inumber))
 		return -1;
+	std::shared_lock<std::shared_timed_mutex> inode_lock(inode_locks[inumber].rw);
+	if(!check_inumber(inumber))
+		return -1;
+
+	//o handle ja fica ocupado; o mapa eh montado fora de handles_lock
+	struct fs_handle *handle;
+	int fd = 0;
+	{
+		std::lock_guard<std::mutex> lock(handles_lock);
+		while(fd < (int)handles.size() && handles[fd].inumber != 0)
+			fd++;
+		if(fd == (int)handles.size())
+			handles.emplace_back();
+		handle = &handles[fd];
+		std::lock_guard<std::mutex> map_lock(handle->lock);
+		handle->inumber = inumber;
+		handle->version = -1;
 	}
+	std::lock_guard<std::mutex> map_lock(handle->lock);
+	handle_map(*handle);
+	return fd;
+}
 
-	Debug<WRITE_TRAIT>::msg("fs_write: begin writing data: \n\tinumber = " + std::to_string(inumber) + "\n\tlength = " + std::to_string(length) + "\n\toffset = " + std::to_string(offset));
+int fs_close( int fd )
+{
+	std::shared_lock<std::shared_timed_mutex> guard(fs_lock);
+	std::lock_guard<std::mutex> lock(handles_lock);
+	if(fd < 0 || fd >= (int)handles.size() || handles[fd].inumber == 0)
+		return 0;
+	handle_free(handles[fd]);
+	return 1;
+}
+
+int fs_pread( int fd, char *data, int length, int offset )
+{
+	std::shared_lock<std::shared_timed_mutex> guard(fs_lock);
+	if(!MOUNTED) {
+		std::cout << "[ERROR] please mount first!" << std::endl;
+		return 0;
+	}
+	int inumber;
+	struct fs_handle *handle = get_handle(fd, inumber);
+	if(!handle)
+		return 0;
+	auto inode_lock = lock_for_read(inumber, (offset + length - 1) / DISK_BLOCK_SIZE);
+	if(!check_handle(handle, inumber))
+		return 0;
+	return read_data(inumber, data, length, offset, handle);
+}
 
-	union fs_block inode, data_block;
+int fs_pwrite( int fd, const char *data, int length, int offset )
+{
+	std::shared_lock<std::shared_timed_mutex> guard(fs_lock);
+	if(!MOUNTED) {
+		std::cout << "[ERROR] please mount first!" << std::endl;
+		return -1;
+	}
+	if(data == NULL){
+		std::cout << "[ERROR] invalid buffer" << std::endl;
+		return -1;
+	}
+	int inumber;
+	struct fs_handle *handle = get_handle(fd, inumber);
+	if(!handle)
+		return -1;
+	inode_write_lock inode_lock(inumber);
+	if(!check_handle(handle, inumber))
+		return -1;
+	if(length <= 0 || offset < 0)
+		return 0;
+	return write_data(inumber, data, length, offset, handle);
+}
 
-	disk_read(inumber/INODES_PER_BLOCK + 1, inode.data);
-	int inode_index = inumber % INODES_PER_BLOCK;
+/*
+Uma view segura fs_lock e o lock do inodo compartilhados ate fs_release_view:
+sem isso um fs_write, fs_delete ou a desfragmentacao poderia reescrever ou
+reaproveitar os blocos enquanto quem chamou ainda le os trechos.
+*/
+struct fs_view_lock {
+	std::shared_lock<std::shared_timed_mutex> fs;
+	std::shared_lock<std::shared_timed_mutex> inode;
+};
 
-	int begin_block = offset / DISK_BLOCK_SIZE;
+int fs_read_view( int fd, int length, int offset, struct fs_view *view )
+{
+	std::shared_lock<std::shared_timed_mutex> guard(fs_lock);
+	view->count = 0;
+	view->npinned = 0;
+	view->copy = NULL;
+	view->lock = NULL;
+	if(!MOUNTED) {
+		std::cout << "[ERROR] please mount first!" << std::endl;
+		return 0;
+	}
+	int inumber;
+	struct fs_handle *handle = get_handle(fd, inumber);
+	if(!handle)
+		return 0;
+	auto inode_lock = lock_for_read(inumber, (offset + std::min(length, FS_VIEW_BLOCKS * DISK_BLOCK_SIZE) - 1) / DISK_BLOCK_SIZE);
+	if(!check_handle(handle, inumber))
+		return 0;
+
+	int size_left = get_inode(inumber).size - offset;
 	int begin_byte = offset % DISK_BLOCK_SIZE;
+	length = std::min(std::min(length, size_left), FS_VIEW_BLOCKS * DISK_BLOCK_SIZE - begin_byte);
+	if(length <= 0 || offset < 0)
+		return 0;
 
-	Debug<WRITE_TRAIT>::msg("fs_write: begin block = " + std::to_string(begin_block));
-	Debug<WRITE_TRAIT>::msg("fs_write: begin byte = " + std::to_string(begin_byte));
-	int length_write, cursor = 0;
-	Debug<WRITE_TRAIT>::msg("fs_write: writing in directs");
-
-	for(int i = begin_block; i < POINTERS_PER_INODE; i++) {
-		if(inode.inode[inode_index].direct[i] == 0){
-			int free_block = search_freeblock();
-			if(free_block == -1) {
-				std::cout << "[ERROR] there is no free space anymore" << std::endl;
-				update_size(inumber,offset, cursor);
-				update_size(inumber,offset, cursor);
-				return cursor;
-			}
-			inode.inode[inode_index].direct[i] = free_block;
-			disk_write(inumber/INODES_PER_BLOCK + 1, inode.data);
-		}
-		length_write = length - begin_byte;
-		if (length_write > DISK_BLOCK_SIZE){
-			length_write = DISK_BLOCK_SIZE - begin_byte;
+	int begin_block = offset / DISK_BLOCK_SIZE;
+	int end_block = (offset + length - 1) / DISK_BLOCK_SIZE;
+
+	std::vector<int> blocks;
+	file_blocks(inumber, begin_block, end_block, blocks, handle);
+	int n = blocks.size();
+	if(n == 0)
+		return 0;
+
+	//o que nao pode ser fixado no cache nem mapeado eh copiado
+	const char *data[FS_VIEW_BLOCKS];
+	int ready = cache_pin_blocks(blocks.data(), n, data);
+	view->npinned = ready;
+	std::copy(data, data + ready, view->pinned);
+	if(ready < n){
+		view->copy = new char[(n - ready) * DISK_BLOCK_SIZE];
+		cache_read_blocks(&blocks[ready], n - ready, view->copy);
+		for(int i = ready; i < n; i++)
+			data[i] = view->copy + (i - ready) * DISK_BLOCK_SIZE;
+	}
+	readahead(inumber, begin_block, end_block, handle);
+
+	//blocos vizinhos na memoria (mapeados, ou na copia) viram um trecho so
+	int cursor = 0;
+	for(int i = 0; i < n && cursor < length; i++){
+		const char *base = data[i] + (i == 0 ? begin_byte : 0);
+		int len = std::min(DISK_BLOCK_SIZE - (i == 0 ? begin_byte : 0), length - cursor);
+		struct iovec *last = view->count > 0 ? &view->iov[view->count - 1] : NULL;
+		if(last && (const char *)last->iov_base + last->iov_len == base){
+			last->iov_len += len;
+		} else {
+			view->iov[view->count].iov_base = (void *)base;
+			view->iov[view->count].iov_len = len;
+			view->count++;
 		}
+		cursor += len;
+	}
+	//os blocos da view nao podem mudar de dono nem de conteudo ate fs_release_view
+	view->lock = new fs_view_lock{std::move(guard), std::move(inode_lock)};
+	Debug<READ_TRAIT>::msg("fs_read_view: " + std::to_string(cursor) + " bytes in " + std::to_string(view->count) + " spans, " + std::to_string(ready) + " blocks without copy");
+	return cursor;
+}
 
-		length -= length_write;
-		Debug<WRITE_TRAIT>::msg("fs_write: writing " + std::to_string(length_write) + " bytes,");
-		#if WRITE_TRAIT == 1
-			if(length < 0){
-				std::cout << std::endl;
-				Debug<WRITE_TRAIT>::msg("fs_write: length < 0");
-			}
-		#endif
-		begin_byte = 0;
-		for(int i = 0; i < DISK_BLOCK_SIZE; i++){
-			data_block.data[i] = 0;
-		}
-
-		std::memcpy(&data_block.data[begin_byte],&data[cursor],length_write);
-		disk_write(inode.inode[inode_index].direct[i],data_block.data);
-		cursor += length_write;
-		begin_block++;
-		if(length == 0) break;
-	}
-	int freespace = 0;
-	for(auto i:data_bitmap)
-		if(i == 1)
-			freespace++;
-	if(length > 0) {
-		Debug<WRITE_TRAIT>::msg("fs_write: writing in indirects");
-		union fs_block indirect;
-		if(inode.inode[inode_index].indirect == 0) {
-			int free_block = search_freeblock();
-			if(free_block == -1 || freespace < 1){
-				std::cout << "[ERROR] there is no free space anymore" << std::endl;
-				update_size(inumber,offset, cursor);
-				return cursor;
-			}
-			inode.inode[inode_index].indirect = free_block;
-			disk_write(inumber/INODES_PER_BLOCK + 1, inode.data);
-		}
-		disk_read(inode.inode[inode_index].indirect, indirect.data);
-		for(int i = begin_block - POINTERS_PER_INODE; i < POINTERS_PER_BLOCK; i++) {
-			if(indirect.pointers[i] == 0){
-				int free_block = search_freeblock();
-				if(free_block == -1) {
-					std::cout << "[ERROR] there is no free space anymore" << std::endl;
-					update_size(inumber,offset, cursor);
-					return cursor;
-				}
-				indirect.pointers[i] = free_block;
-				disk_write(inode.inode[inode_index].indirect, indirect.data);
-			}
-			length_write = length - begin_byte;
-			if (length_write > DISK_BLOCK_SIZE){
-				length_write = DISK_BLOCK_SIZE - begin_byte;
-			}
+void fs_release_view( struct fs_view *view )
+{
+	for(int i = 0; i < view->npinned; i++)
+		cache_unpin(view->pinned[i]);
+	delete[] view->copy;
+	delete (struct fs_view_lock *)view->lock;
+	view->count = 0;
+	view->npinned = 0;
+	view->copy = NULL;
+	view->lock = NULL;
+}
 
-			length -= length_write;
-			Debug<WRITE_TRAIT>::msg("fs_write: writing " + std::to_string(length_write) + " bytes,");
-			#if WRITE_TRAIT == 1
-				if(length < 0){
-					std::cout << std::endl;
-					Debug<WRITE_TRAIT>::msg("fs_write: length < 0");
-				}
-			#endif
-			begin_byte = 0;
-			for(int i = 0; i < DISK_BLOCK_SIZE; i++){
-				data_block.data[i] = 0;
-			}
+/*
+Reserva os blocos de offset a offset+length-1 sem mudar o tamanho do arquivo.
+Os blocos reservados ja estao zerados (todo bloco livre esta), entao ler ou
+escrever so parte deles depois da o mesmo resultado que num bloco novo.
+*/
+int fs_fallocate( int inumber, int offset, int length )
+{
+	std::shared_lock<std::shared_timed_mutex> guard(fs_lock);
+	Debug<WRITE_TRAIT>::msg("fs_fallocate: ### BEGIN ###");
+	if(!MOUNTED) {
+		std::cout << "[ERROR] please mount first!" << std::endl;
+		return 0;
+	}
+	if(!check_range(inumber))
+		return 0;
+	inode_write_lock inode_lock(inumber);
+	if(!check_inumber(inumber))
+		return 0;
+	if(length <= 0 || offset < 0)
+		return 0;
 
-			std::memcpy(&data_block.data[begin_byte],&data[cursor],length_write);
-			disk_write(indirect.pointers[i],data_block.data);
-			cursor += length_write;
-			begin_block++;
-			if(length == 0) break;
-		}
+	int begin_block = offset / DISK_BLOCK_SIZE;
+	int end_block = (offset + length - 1) / DISK_BLOCK_SIZE;
+
+	delayed_flush(inumber);
+
+	int need;
+	int hint = range_hint(inumber, begin_block, end_block, need);
+	if(need <= 0)
+		return 1;
+
+	fs_modified();
+	Debug<WRITE_TRAIT>::msg("fs_fallocate: reserving " + std::to_string(need) + " blocks at " + std::to_string(hint));
+
+	std::vector<int> blocks;
+	std::vector<bool> fresh;
+	bool full = false, nospace = false;
+	if(extents_format())
+		extent_allocate(inumber, begin_block, end_block, blocks, fresh, full, nospace, hint);
+	else
+		pointer_allocate(inumber, begin_block, end_block, blocks, fresh, full, nospace, hint);
+
+	if(nospace)
+		std::cout << "[ERROR] there is no free space anymore" << std::endl;
+	if(full)
+		std::cout << "[ERROR] file reached the maximum size" << std::endl;
+
+	Debug<WRITE_TRAIT>::msg("fs_fallocate: ### END ###");
+	return !nospace && !full;
+}
+
+/*
+Desfragmentacao em duas fases. Primeiro o layout final eh calculado na
+memoria: os arquivos em ordem de inumber, cada um contiguo a partir do comeco
+da area de dados (no formato com ponteiros, cada indireto seguido dos blocos
+abaixo dele). Os destinos formam uma permutacao, que se decompoe em cadeias,
+que terminam num bloco livre e sao copiadas do fim para o comeco, e ciclos,
+que guardam um bloco so num buffer. Cada bloco eh copiado uma vez, no maximo,
+em lotes de DEFRAG_BATCH_BLOCKS. No fim os ponteiros sao corrigidos pelo mapa
+reverso, gravando uma vez so cada inodo e cada indireto que mudou.
+*/
+const int DEFRAG_BATCH_BLOCKS = 256;
+
+struct defrag_plan {
+	std::vector<int> order;		//blocos atuais, na ordem do layout final
+	std::vector<int> target;	//destino de cada bloco atual, 0 para os que nao sao de ninguem
+	std::vector<int> freed;		//blocos de extents que nao serao mais usados
+};
+
+static void defrag_order_tree(int block, int level, std::vector<int> &order, std::vector<int> &levels){
+	order.push_back(block);
+	levels.push_back(level);
+	if(level == 0)
+		return;
+	union fs_block node;
+	cache_read(block, node.data);
+	for(int i = 0; i < POINTERS_PER_BLOCK; i++)
+		if(node.pointers[i] != 0)
+			defrag_order_tree(node.pointers[i], level - 1, order, levels);
+}
+
+//blocos do arquivo na ordem em que ficam depois de desfragmentado, e o nivel de cada um
+static void defrag_file_order(int inumber, std::vector<int> &order, std::vector<int> &levels){
+	struct fs_inode &inode = get_inode(inumber);
+	if(extents_format()){
+		std::vector<struct fs_extent> extents;
+		load_extents(inode, extents);
+		for(auto &e : extents)
+			for(int b = 0; b < e.length; b++)
+				order.push_back(e.start + b);
+		levels.resize(order.size(), 0);
+		return;
 	}
+	for(int p = 0; p < direct_pointers() + indirect_levels(); p++)
+		if(inode.pointers[p] != 0)
+			defrag_order_tree(inode.pointers[p], pointer_level(p), order, levels);
+}
 
-	Debug<WRITE_TRAIT>::msg("fs_write: ### END ###");
-	update_size(inumber,offset, cursor);
-	return cursor;
+static void defrag_plan_build(struct defrag_plan &plan){
+	std::vector<int> levels;
+	for(int i = 1; i < superblock.ninodes; i++){
+		if(inode_bitmap[i] == 0)
+			continue;
+		defrag_file_order(i, plan.order, levels);
+		//um arquivo contiguo cabe num extent so, e o bloco de extents sobra
+		if(extents_format() && get_inode(i).extentblock != 0)
+			plan.freed.push_back(get_inode(i).extentblock);
+	}
+	plan.target.assign(superblock.nblocks, 0);
+	int pos = data_start(superblock);
+	for(int block : plan.order)
+		plan.target[block] = pos++;
 }
 
-int aux_findid (int iblock){ //Erro nessa funcao
+//copia src[i] para dst[i] em lotes; cada destino ja foi lido antes, se tinha algo a mover
+static void defrag_copy(const std::vector<int> &src, const std::vector<int> &dst){
+	std::vector<char> buffer(DEFRAG_BATCH_BLOCKS * DISK_BLOCK_SIZE);
+	for(size_t i = 0; i < src.size(); i += DEFRAG_BATCH_BLOCKS){
+		int n = std::min(src.size() - i, (size_t)DEFRAG_BATCH_BLOCKS);
+		cache_read_blocks(&src[i], n, buffer.data());
+		cache_write_blocks(&dst[i], n, buffer.data());
+	}
+}
 
-	union fs_block block;
-	union fs_block inode;
+//libera os blocos que ficaram para tras; descartados, eles voltam a ser lidos como zero
+static void defrag_release(std::vector<int> &blocks){
+	std::sort(blocks.begin(), blocks.end());
+	for(size_t i = 0; i < blocks.size(); ){
+		size_t j = i + 1;
+		while(j < blocks.size() && blocks[j] == blocks[j - 1] + 1)
+			j++;
+		cache_discard(blocks[i], j - i);
+		disk_discard(blocks[i], j - i);
+		for(size_t k = i; k < j; k++){
+			data_bitmap.clear(blocks[k]);
+			disk_classify(blocks[k], DISK_CLASS_DATA);
+			owner_clear(blocks[k]);
+		}
+		i = j;
+	}
+}
+
+//devolve quantos blocos foram copiados
+static int defrag_execute(const struct defrag_plan &plan){
+	const std::vector<int> &target = plan.target;
+	int nblocks = superblock.nblocks;
+	auto moves = [&](int b){ return target[b] != 0 && target[b] != b; };
+
+	std::vector<char> wanted(nblocks, 0);
+	for(int b = 0; b < nblocks; b++)
+		if(moves(b))
+			wanted[target[b]] = 1;
+
+	std::vector<int> classes(nblocks);
+	for(int b = 0; b < nblocks; b++)
+		if(moves(b))
+			classes[b] = disk_class(b);
+
+	//cadeias: comecam num bloco que ninguem quer e terminam num destino que nao se move
+	std::vector<char> done(nblocks, 0);
+	std::vector<int> src, dst, vacated;
+	for(int b = 0; b < nblocks; b++){
+		if(!moves(b) || wanted[b])
+			continue;
+		std::vector<int> chain;
+		for(int c = b; moves(c); c = target[c]){
+			chain.push_back(c);
+			done[c] = 1;
+		}
+		for(auto it = chain.rbegin(); it != chain.rend(); ++it){
+			src.push_back(*it);
+			dst.push_back(target[*it]);
+		}
+		vacated.push_back(b);
+	}
+	defrag_copy(src, dst);
+	int copied = src.size();
+
+	//o que sobrou sao ciclos: o ultimo bloco espera no buffer enquanto os outros andam
+	int cycles = 0;
+	for(int b = 0; b < nblocks; b++){
+		if(!moves(b) || done[b])
+			continue;
+		std::vector<int> cycle;
+		for(int c = b; !done[c]; c = target[c]){
+			cycle.push_back(c);
+			done[c] = 1;
+		}
+		union fs_block saved;
+		cache_read(cycle.back(), saved.data);
+		src.clear();
+		dst.clear();
+		for(int k = cycle.size() - 2; k >= 0; k--){
+			src.push_back(cycle[k]);
+			dst.push_back(cycle[k + 1]);
+		}
+		defrag_copy(src, dst);
+		cache_write(cycle[0], saved.data);
+		copied += cycle.size();
+		cycles++;
+	}
 
-	disk_read(0,block.data);
+	for(int b = 0; b < nblocks; b++){
+		if(moves(b)){
+			disk_classify(target[b], classes[b]);
+			data_bitmap.set(target[b]);
+		}
+	}
 
-	Debug<DEFRAG_TRAIT>::msg("aux_findid: enter in funciton, search inode for append block " + std::to_string(iblock));
+	//blocos de extents que sobraram fora da area nova tambem ficam livres
+	for(int b : plan.freed)
+		if(!wanted[b] && target[b] == 0)
+			vacated.push_back(b);
 
-	for (int i = 0; i < block.super.ninodes; i++) {
-		if(inode_bitmap[i] == 1) {
-			disk_read(i/INODES_PER_BLOCK + 1, inode.data);
+	defrag_release(vacated);
 
-			Debug<DEFRAG_TRAIT>::msg("aux_findid: enter in block " + std::to_string(i/INODES_PER_BLOCK + 1) + " inode " + std::to_string(i));
+	Debug<DEFRAG_TRAIT>::msg("fs_defrag: " + std::to_string(copied) + " blocks copied, " + std::to_string(cycles) + " cycles");
+	return copied;
+}
 
-			for(int j = 0 ; j < POINTERS_PER_INODE; j++){
-				if(inode.inode[i%INODES_PER_BLOCK].direct[j] == iblock){
-					Debug<DEFRAG_TRAIT>::msg("aux_findid: find append " + std::to_string(iblock) + " in inode " + std::to_string(i%INODES_PER_BLOCK) + " per direct pointer");
-					return i;
-				}
-			}
-			if(inode.inode[i%INODES_PER_BLOCK].indirect != 0){
-				if(inode.inode[i%INODES_PER_BLOCK].indirect == iblock){
-					return i;
-				}
-				union fs_block indirect;
-				disk_read(inode.inode[i%INODES_PER_BLOCK].indirect, indirect.data);
-				for(int j = 0; j < POINTERS_PER_BLOCK; j++){
-					if(indirect.pointers[j] == iblock){
-						Debug<DEFRAG_TRAIT>::msg("aux_findid: find append" + std::to_string(iblock) + " in inode " + std::to_string(i%INODES_PER_BLOCK) + " per indirect pointer " + std::to_string(j));
-						return i;
-					}
-				}
-			}
+/*
+Corrige os ponteiros para os destinos do plano, e o mapa reverso. Roda antes
+das copias: os indiretos sao corrigidos onde estao e levam os ponteiros novos
+quando forem copiados para o lugar deles.
+*/
+static void defrag_relink(const struct defrag_plan &plan){
+	const std::vector<int> &target = plan.target;
+	auto moved = [&](int b){ return b > 0 && target[b] != 0 ? target[b] : b; };
+
+	//cada indireto que tem ponteiros a mudar eh lido e gravado uma vez
+	std::map<int, std::vector<std::pair<int, int>>> patches;
+	std::vector<struct fs_slot> relocated(superblock.nblocks, fs_slot{0, 0, 0});
+	for(int b : plan.order){
+		struct fs_slot slot;
+		owner_find(b, slot);
+		if(slot.parent > 0){
+			if(target[b] != b)
+				patches[slot.parent].push_back(std::make_pair(slot.index, target[b]));
+			slot.parent = moved(slot.parent);
+		} else if(slot.parent == 0 && target[b] != b){
+			get_inode(slot.inumber).pointers[slot.index] = target[b];
+			mark_inode(slot.inumber);
+		} else if(slot.parent < 0){
+			slot.index = 0;
 		}
+		relocated[target[b]] = slot;
+	}
+	for(auto &p : patches){
+		union fs_block node;
+		cache_read(p.first, node.data);
+		for(auto &change : p.second)
+			node.pointers[change.first] = change.second;
+		cache_write(p.first, node.data);
 	}
 
-	return -1;
+	if(extents_format()){
+		int pos = data_start(superblock);
+		for(int i = 1; i < superblock.ninodes; i++){
+			if(inode_bitmap[i] == 0)
+				continue;
+			struct fs_inode &inode = get_inode(i);
+			std::vector<struct fs_extent> extents;
+			load_extents(inode, extents);
+			int length = 0;
+			for(auto &e : extents)
+				length += e.length;
+			inode.extents[0] = fs_extent{length ? pos : 0, length};
+			for(int k = 1; k < EXTENTS_PER_INODE; k++)
+				inode.extents[k] = fs_extent{0, 0};
+			inode.nextents = length ? 1 : 0;
+			inode.extentblock = 0;
+			mark_inode(i);
+			pos += length;
+		}
+	}
+	owners.swap(relocated);
 }
 
 int fs_defrag (){
+	std::unique_lock<std::shared_timed_mutex> guard(fs_lock);
 
 	Debug<DEFRAG_TRAIT>::msg("fs_defrag: ### BEGIN ###");
 
@@ -681,296 +2442,324 @@ int fs_defrag (){
 	}
 
 	Debug<DEFRAG_TRAIT>::msg("fs_defrag: begin defrag, initializing ready disk");
+	fs_modified();
+	delayed_flush_all();
 
-	union fs_block block;
-
-	disk_read(0,block.data);
-
-	if(block.super.magic != FS_MAGIC){
+	if(superblock.magic != FS_MAGIC){
 		std::cout << "[ERROR] magic number is invalid" << std::endl;
 		return 0;
 	}
 
-	int pos = block.super.ninodeblocks + 1;
+	defrag_reset();
+	struct defrag_plan plan;
+	defrag_plan_build(plan);
+	defrag_relink(plan);
+	defrag_execute(plan);
+	leaf_cache_forget(-1);
+	layout_changed(-1);
 
-	int var_aux = 0;
-	union fs_block inode;
-	union fs_block indirect;
-	union fs_block data;
-	union fs_block aux;
-	int inodo_change;
+	Debug<DEFRAG_TRAIT>::msg("fs_defrag: ##### END #####");
+
+	return 1;
+}
+
+/*
+Desfragmentacao incremental. Cada passo faz no maximo max_moves copias ou
+max_ms milissegundos de trabalho e devolve o controle; o cursor guarda onde
+parar e de onde continuar. Os arquivos sao vistos em ordem de inumber: um
+arquivo fragmentado ganha um trecho livre do tamanho dele, reservado no
+bitmap, e os blocos vao para la em lotes. Cada lote eh completo (copia,
+ponteiros, liberacao dos blocos velhos) e roda com fs_lock, entao uma leitura
+ou escrita entre dois lotes ve o arquivo inteiro, parte no lugar novo e parte
+no velho. Se o arquivo mudou entre dois passos (foi apagado, por exemplo), o
+que sobrou da reserva eh devolvido e o cursor segue para o proximo.
+*/
+const int DEFRAG_IDLE_MS = 10;	//pausa da thread entre dois passos
+
+std::thread defrag_thread;
+std::atomic<bool> defrag_running(false);
+
+//devolve a reserva e passa para o proximo arquivo
+static void defrag_abandon(){
+	defrag_reserve(false);
+	cursor.dest = 0;
+	cursor.inumber++;
+}
+
+//copia order[first..first+n) para dest+first..., corrigindo ponteiros e o mapa reverso
+static void defrag_move(int inumber, const std::vector<int> &order, const std::vector<int> &levels, int first, int n, int dest){
+	std::vector<int> src(order.begin() + first, order.begin() + first + n), dst;
+	for(int i = 0; i < n; i++)
+		dst.push_back(dest + first + i);
+	defrag_copy(src, dst);
+
+	//os pais vem antes dos filhos na ordem, entao o pai de cada bloco ja esta no lugar certo do mapa
+	std::map<int, std::vector<std::pair<int, int>>> patches;
+	for(int i = 0; i < n; i++){
+		struct fs_slot slot;
+		owner_find(src[i], slot);
+		if(slot.parent > 0)
+			patches[slot.parent].push_back(std::make_pair(slot.index, dst[i]));
+		else if(slot.parent == 0){
+			get_inode(inumber).pointers[slot.index] = dst[i];
+			mark_inode(inumber);
+		}
+		owners[dst[i]] = slot;
+		disk_classify(dst[i], disk_class(src[i]));
+		if(levels[first + i] > 0){
+			union fs_block node;
+			cache_read(dst[i], node.data);
+			for(int k = 0; k < POINTERS_PER_BLOCK; k++)
+				if(node.pointers[k] != 0)
+					owners[node.pointers[k]].parent = dst[i];
+		}
+	}
+	for(auto &p : patches){
+		union fs_block node;
+		cache_read(p.first, node.data);
+		for(auto &change : p.second)
+			node.pointers[change.first] = change.second;
+		cache_write(p.first, node.data);
+	}
+
+	//com extents, o trecho ja copiado vira um extent e o resto continua como estava
+	if(extents_format()){
+		struct fs_inode &inode = get_inode(inumber);
+		std::vector<struct fs_extent> extents, moved;
+		load_extents(inode, extents);
+		moved.push_back(fs_extent{dest, first + n});
+		std::vector<int> rest;
+		extent_blocks(extents, first + n, order.size() - 1, rest);
+		for(int b : rest){
+			if(moved.back().start + moved.back().length == b)
+				moved.back().length++;
+			else
+				moved.push_back(fs_extent{b, 1});
+		}
+		for(size_t k = 0; k < moved.size(); k++)
+			for(int b = 0; b < moved[k].length; b++)
+				owners[moved[k].start + b] = fs_slot{inumber, -1, (int)k};
+		store_extents(inumber, moved);
+	}
 
-	for (int i = 0; i < block.super.ninodes; i++) {
+	defrag_release(src);
+	leaf_cache_forget(inumber);
+	layout_changed(inumber);
+}
 
-		Debug<DEFRAG_TRAIT>::msg("fs_defrag: verific inode " + std::to_string(i));
+//escolhe o proximo arquivo fragmentado e reserva o trecho dele; false no fim da passada
+static bool defrag_next_file(){
+	for(; cursor.inumber < superblock.ninodes; cursor.inumber++){
+		if(inode_bitmap[cursor.inumber] == 0)
+			continue;
+		delayed_flush(cursor.inumber);
+		std::vector<int> order, levels;
+		defrag_file_order(cursor.inumber, order, levels);
+		int n = order.size();
+		bool contiguous = true;
+		for(int i = 1; i < n && contiguous; i++)
+			contiguous = order[i] == order[i - 1] + 1;
+		if(contiguous)
+			continue;
+		//com todos os extents usados, mover so uma parte criaria mais um
+		if(extents_format() && get_inode(cursor.inumber).nextents >= MAX_EXTENTS)
+			continue;
+		//e o extent a mais pode nao caber no inodo
+		struct fs_inode &inode = get_inode(cursor.inumber);
+		int extentblock = 0;
+		if(extents_format() && inode.extentblock == 0){
+			extentblock = alloc_block(cursor.inumber, 0);
+			if(extentblock == -1)
+				continue;
+		}
+		int start = data_bitmap.find_free_run(data_start(superblock), n);
+		if(start == -1){
+			//sem trecho para o arquivo, o bloco de extents nao eh usado
+			if(extentblock > 0)
+				free_block(extentblock);
+			continue;
+		}
+		if(extentblock > 0){
+			fs_modified();
+			inode.extentblock = extentblock;
+			owner_set(extentblock, fs_slot{cursor.inumber, -1, -1});
+			disk_classify(extentblock, DISK_CLASS_INDIRECT);
+			mark_inode(cursor.inumber);
+		}
+		Debug<DEFRAG_TRAIT>::msg("fs_defrag_step: inode " + std::to_string(cursor.inumber) + " goes to " + std::to_string(start) + "+" + std::to_string(n));
+		cursor.dest = start;
+		cursor.length = n;
+		cursor.placed = 0;
+		defrag_reserve(true);
+		return true;
+	}
+	cursor.inumber = 1;
+	return false;
+}
 
-		if(inode_bitmap[i] == 1) {
+int fs_defrag_step( int max_moves, int max_ms )
+{
+	std::unique_lock<std::shared_timed_mutex> guard(fs_lock);
+	Debug<DEFRAG_TRAIT>::msg("fs_defrag_step: ### BEGIN ###");
 
-			Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " is used");
+	if(!MOUNTED) {
+		std::cout << "[ERROR] please mount first!" << std::endl;
+		return -1;
+	}
+	if(max_moves <= 0 || max_ms <= 0){
+		std::cout << "[ERROR] defrag budget must be positive!" << std::endl;
+		return -1;
+	}
 
-			disk_read(i/INODES_PER_BLOCK + 1, inode.data);
+	auto begin = std::chrono::steady_clock::now();
+	int moves = 0;
+	while(moves < max_moves && std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(max_ms)){
+		if(cursor.dest == 0 && !defrag_next_file()){
+			Debug<DEFRAG_TRAIT>::msg("fs_defrag_step: pass finished");
+			return 0;
+		}
 
-			for(int j = 0 ; j < POINTERS_PER_INODE; j++){
-				if(inode.inode[i%INODES_PER_BLOCK].direct[j] == pos){
-					Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " direct pointer " + std::to_string(j) + " already ordered");
+		//o que ja foi copiado tem que continuar no comeco do trecho
+		std::vector<int> order, levels;
+		if(inode_bitmap[cursor.inumber] != 0)
+			defrag_file_order(cursor.inumber, order, levels);
+		bool changed = (int)order.size() < cursor.placed;
+		for(int i = 0; i < cursor.placed && !changed; i++)
+			changed = order[i] != cursor.dest + i;
+		if(changed){
+			Debug<DEFRAG_TRAIT>::msg("fs_defrag_step: inode " + std::to_string(cursor.inumber) + " changed, giving up its move");
+			defrag_abandon();
+			continue;
+		}
 
-					pos++;
-					if(pos == block.super.nblocks){
-						return 1;
-					}
-				}
-				else if(inode.inode[i%INODES_PER_BLOCK].direct[j] != 0){
-
-					Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " direct pointer " + std::to_string(j) + " ordering");
-
-					if(data_bitmap[pos] ==  1){
-
-						disk_read(pos, aux.data);
-						disk_read(inode.inode[i%INODES_PER_BLOCK].direct[j], data.data);
-						disk_write(pos,data.data);
-						disk_write(inode.inode[i%INODES_PER_BLOCK].direct[j],aux.data);
-
-						inodo_change = aux_findid(pos);
-
-						disk_read(inodo_change/INODES_PER_BLOCK + 1,aux.data);
-						var_aux = 0;
-						for(int k = 0;k < POINTERS_PER_INODE; k++){
-							if(aux.inode[inodo_change%INODES_PER_BLOCK].direct[k] == pos){
-								if(inodo_change/INODES_PER_BLOCK != i/INODES_PER_BLOCK){
-									aux.inode[inodo_change%INODES_PER_BLOCK].direct[k] = inode.inode[i%INODES_PER_BLOCK].direct[j];
-									disk_write(inodo_change/INODES_PER_BLOCK + 1,aux.data);
-								}
-								else{
-									inode.inode[inodo_change%INODES_PER_BLOCK].direct[k] = inode.inode[i%INODES_PER_BLOCK].direct[j];
-								}
-								Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " direct pointer " + std::to_string(j) + " change data with inode " + std::to_string(inodo_change) + " direct pointer " + std::to_string(k));
-								if(DEFRAG_TRAIT){
-									disk_write(i/INODES_PER_BLOCK + 1, inode.data);
-									fs_debug();
-								}
-								var_aux = 1; //if pos refereced for direct pointer
-								break;
-							}
-						}
-						if(var_aux == 0){ //if pos refereced for indirect pointer
-							if(aux.inode[inodo_change%INODES_PER_BLOCK].indirect == pos){
-								if(inodo_change/INODES_PER_BLOCK != i/INODES_PER_BLOCK){
-									aux.inode[inodo_change%INODES_PER_BLOCK].indirect = inode.inode[i%INODES_PER_BLOCK].direct[j];
-									disk_write(inodo_change/INODES_PER_BLOCK + 1,aux.data);
-								}else{
-									inode.inode[inodo_change%INODES_PER_BLOCK].indirect = inode.inode[i%INODES_PER_BLOCK].direct[j];
-								}
-								if(DEFRAG_TRAIT){
-									disk_write(i/INODES_PER_BLOCK + 1, inode.data);
-									fs_debug();
-								}
-								Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " direct pointer " + std::to_string(j) + " change data with inode " + std::to_string(inodo_change) + " indirect pointer");
-							}
-							else{
-								var_aux = aux.inode[inodo_change%INODES_PER_BLOCK].indirect;
-								disk_read(var_aux, aux.data);
-								for(int k = 0;k < POINTERS_PER_BLOCK;k++){
-									if(aux.pointers[k] == pos){
-										aux.pointers[k] = inode.inode[i%INODES_PER_BLOCK].direct[j];
-										disk_write(var_aux, aux.data);
-										Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " direct pointer " + std::to_string(j) + " change data with inode " + std::to_string(inodo_change) + " indirect pointer " + std::to_string(k));
-										break;
-									}
-								}
-							}
-						}
-					}
-					else{
-						Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " direct pointer " + std::to_string(j) + " change data for pos " + std::to_string(pos));
+		int n = std::min(cursor.length, (int)order.size()) - cursor.placed;
+		n = std::min(n, std::min(max_moves - moves, DEFRAG_BATCH_BLOCKS));
+		if(n <= 0){
+			defrag_abandon();
+			continue;
+		}
+		fs_modified();
+		defrag_move(cursor.inumber, order, levels, cursor.placed, n, cursor.dest);
+		cursor.placed += n;
+		moves += n;
+	}
 
-						disk_read(inode.inode[i%INODES_PER_BLOCK].direct[j], data.data);
-						disk_write(pos,data.data);
-						data_bitmap[inode.inode[i%INODES_PER_BLOCK].direct[j]] = 0;
-						data_bitmap[pos] = 1;
-					}
-					inode.inode[i%INODES_PER_BLOCK].direct[j] = pos;
-					Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " direct pointer changed finished");
-					pos++;
-					if(pos == block.super.nblocks){
-						return 1;
-					}
-				}
-				disk_write(i/INODES_PER_BLOCK + 1, inode.data);
-			}
-			if(inode.inode[i%INODES_PER_BLOCK].indirect == pos){
-				Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer " + std::to_string(inode.inode[i%INODES_PER_BLOCK].indirect) + " already ordened");
-				pos++;
-				if(pos == block.super.nblocks){
-					return 1;
-				}
-			}
-			else if(inode.inode[i%INODES_PER_BLOCK].indirect != 0){
-				if(data_bitmap[pos] == 1){
-					disk_read(pos, aux.data);
-					disk_read(inode.inode[i%INODES_PER_BLOCK].indirect, data.data);
-					disk_write(pos,data.data);
-					disk_write(inode.inode[i%INODES_PER_BLOCK].indirect,aux.data);
-
-					inodo_change = aux_findid(pos);
-
-					Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer change data with inode " + std::to_string(inodo_change));
-
-					disk_read(inodo_change/INODES_PER_BLOCK + 1,aux.data);
-					var_aux = 0;
-					for(int k = 0;k < POINTERS_PER_INODE; k++){
-						if(aux.inode[inodo_change%INODES_PER_BLOCK].direct[k] == pos){
-							if(inodo_change/INODES_PER_BLOCK != i/INODES_PER_BLOCK){
-								aux.inode[inodo_change%INODES_PER_BLOCK].direct[k] = inode.inode[i%INODES_PER_BLOCK].indirect;
-								disk_write(inodo_change/INODES_PER_BLOCK + 1,aux.data);
-							}else{
-								inode.inode[inodo_change%INODES_PER_BLOCK].direct[k] = inode.inode[i%INODES_PER_BLOCK].indirect;
-							}
-							Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer change data with inode " + std::to_string(inodo_change) + " direct pointer " + std::to_string(k));
-							if(DEFRAG_TRAIT){
-								disk_write(i/INODES_PER_BLOCK + 1, inode.data);
-								fs_debug();
-							}
-							var_aux = 1; //if pos refereced for direct pointer
-							break;
-						}
-					}
-					if(var_aux == 0){ //if pos refereced for indirect pointer
-						if(aux.inode[inodo_change%INODES_PER_BLOCK].indirect == pos){
-							if(inodo_change/INODES_PER_BLOCK != i/INODES_PER_BLOCK){
-								aux.inode[inodo_change%INODES_PER_BLOCK].indirect = inode.inode[i%INODES_PER_BLOCK].indirect;
-								disk_write(inodo_change/INODES_PER_BLOCK + 1,aux.data);
-							}
-							else{
-								inode.inode[inodo_change%INODES_PER_BLOCK].indirect = inode.inode[i%INODES_PER_BLOCK].indirect;
-							}
-							if(DEFRAG_TRAIT){
-								disk_write(i/INODES_PER_BLOCK + 1, inode.data);
-								fs_debug();
-							}
-							Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer change data with inode " + std::to_string(inodo_change) + " indirect pointer");
-						}
-						else{
-							var_aux = aux.inode[inodo_change%INODES_PER_BLOCK].indirect;
-							disk_read(var_aux, aux.data);
-							for(int k = 0;k < POINTERS_PER_BLOCK;k++){
-								if(aux.pointers[k] == pos){
-									aux.pointers[k] = inode.inode[i%INODES_PER_BLOCK].indirect;
-									disk_write(var_aux, aux.data);
-									Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer change data with inode " + std::to_string(inodo_change) + " indirect pointer " + std::to_string(k));
-									break;
-								}
-							}
-						}
-					}
-				}
-				else{
-					Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer change data for pos " + std::to_string(pos));
+	Debug<DEFRAG_TRAIT>::msg("fs_defrag_step: " + std::to_string(moves) + " blocks moved");
+	return 1;
+}
 
-					disk_read(inode.inode[i%INODES_PER_BLOCK].indirect, data.data);
-					disk_write(pos,data.data);
-					data_bitmap[inode.inode[i%INODES_PER_BLOCK].indirect] = 0;
-					data_bitmap[pos] = 1;
-				}
-				inode.inode[i%INODES_PER_BLOCK].indirect = pos;
-				Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer changed finished");
-				pos++;
-				if(pos == block.super.nblocks){
-					return 1;
-				}
-			}
-			if(inode.inode[i%INODES_PER_BLOCK].indirect != 0){
-				disk_read(inode.inode[i%INODES_PER_BLOCK].indirect, indirect.data);
-				for(int j = 0; j < POINTERS_PER_BLOCK; j++){
-					//Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer " + std::to_string(j) + " ordering");
-					if(indirect.pointers[j] == pos){
-						Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer " + std::to_string(indirect.pointers[j]) + " already ordere");
-						pos++;
-						if(pos == block.super.nblocks){
-							return 1;
-						}
-					}
-					else if(indirect.pointers[j] != 0){
-						if(data_bitmap[pos] ==  1){
-
-							disk_read(pos, aux.data);
-							disk_read(indirect.pointers[j], data.data);
-							disk_write(pos,data.data);
-							disk_write(indirect.pointers[j],aux.data);
-
-							inodo_change = aux_findid(pos);
-
-							Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer " + std::to_string(indirect.pointers[j]) + " change data with inode " + std::to_string(inodo_change));
-
-							disk_read(inodo_change/INODES_PER_BLOCK + 1,aux.data);
-							var_aux = 0;
-							for(int k = 0;k < POINTERS_PER_INODE; k++){
-								if(aux.inode[inodo_change%INODES_PER_BLOCK].direct[k] == pos){
-									if(inodo_change/INODES_PER_BLOCK != i/INODES_PER_BLOCK){
-										aux.inode[inodo_change%INODES_PER_BLOCK].direct[k] = indirect.pointers[j];
-										disk_write(inodo_change/INODES_PER_BLOCK + 1,aux.data);
-									}
-									else{
-										inode.inode[inodo_change%INODES_PER_BLOCK].direct[k] = indirect.pointers[j];
-									}
-									Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer " + std::to_string(indirect.pointers[j]) + " change data with inode " + std::to_string(inodo_change) + " direct pointer " + std::to_string(k));
-									var_aux = 1; //if pos refereced for direct pointer
-									if(DEFRAG_TRAIT){
-										disk_write(i/INODES_PER_BLOCK + 1, inode.data);
-										fs_debug();
-									}
-									break;
-								}
-							}
-							if(var_aux == 0){ //if pos refereced for indirect pointer
-								if(aux.inode[inodo_change%INODES_PER_BLOCK].indirect == pos){
-									if(inodo_change/INODES_PER_BLOCK != i/INODES_PER_BLOCK){
-										aux.inode[inodo_change%INODES_PER_BLOCK].indirect = indirect.pointers[j];
-										disk_write(inodo_change/INODES_PER_BLOCK + 1,aux.data);
-									}
-									else{
-										inode.inode[inodo_change%INODES_PER_BLOCK].indirect = indirect.pointers[j];
-									}
-									Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer " + std::to_string(j) + " change data with inode " + std::to_string(inodo_change) + " indirect pointer");
-								}
-								else{
-									var_aux = aux.inode[inodo_change%INODES_PER_BLOCK].indirect;
-									disk_read(var_aux, aux.data);
-									for(int k = 0;k < POINTERS_PER_BLOCK;k++){
-										if(aux.pointers[k] == pos){
-											aux.pointers[k] = indirect.pointers[j];
-											disk_write(var_aux, aux.data);
-											Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer " + std::to_string(indirect.pointers[j]) + " change data with inode " + std::to_string(inodo_change) + " indirect pointer " + std::to_string(k));
-											if(DEFRAG_TRAIT){
-												disk_write(i/INODES_PER_BLOCK + 1, inode.data);
-												fs_debug();
-											}
-											break;
-										}
-									}
-								}
-							}
-						}
-						else{
-							disk_read(indirect.pointers[j], data.data);
-							disk_write(pos,data.data);
-							data_bitmap[indirect.pointers[j]] = 0;
-							data_bitmap[pos] = 1;
-						}
-						indirect.pointers[j] = pos;
-						Debug<DEFRAG_TRAIT>::msg("fs_defrag: inode " + std::to_string(i) + " indirect pointer changed finished");
-						pos++;
-						if(pos == block.super.nblocks){
-							return 1;
-						}
-					disk_write(inode.inode[i%INODES_PER_BLOCK].indirect, indirect.data);
-					}
-				}
-			}
-			disk_write(i/INODES_PER_BLOCK + 1, inode.data);
+static void defrag_background(int max_moves, int max_ms){
+	while(defrag_running){
+		if(fs_defrag_step(max_moves, max_ms) <= 0)
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(DEFRAG_IDLE_MS));
+	}
+	defrag_running = false;
+}
+
+int fs_defrag_start( int max_moves, int max_ms )
+{
+	//sem orcamento cada passo voltaria sem fazer nada e a thread nunca pararia
+	if(max_moves <= 0 || max_ms <= 0){
+		std::cout << "[ERROR] defrag budget must be positive!" << std::endl;
+		return -1;
+	}
+	std::lock_guard<std::mutex> lock(defrag_control);
+	if(defrag_running)
+		return 0;
+	if(defrag_thread.joinable())
+		defrag_thread.join();
+	defrag_running = true;
+	defrag_thread = std::thread(defrag_background, max_moves, max_ms);
+	return 1;
+}
+
+void fs_defrag_stop()
+{
+	std::lock_guard<std::mutex> lock(defrag_control);
+	defrag_running = false;
+	if(defrag_thread.joinable())
+		defrag_thread.join();
+}
+
+/*
+Analise da fragmentacao, sem mover nenhum bloco; so os buffers da alocacao
+atrasada sao gravados antes, como no fs_sync. Ler um arquivo inteiro
+custa um pedido por trecho; depois de fs_defrag() custaria um so, entao a
+economia estimada eh runs - files pedidos e seekblocks blocos de busca.
+*/
+int fs_fraginfo( struct fs_fraginfo *info, int verbose )
+{
+	std::unique_lock<std::shared_timed_mutex> guard(fs_lock);
+
+	if(!MOUNTED) {
+		std::cout << "[ERROR] please mount first!" << std::endl;
+		return 0;
+	}
+
+	std::memset(info, 0, sizeof(*info));
+	//as escritas ainda sem blocos entram na conta ja no lugar delas
+	delayed_flush_all();
+
+	for(int i = 1; i < superblock.ninodes; i++){
+		if(inode_bitmap[i] == 0)
+			continue;
+		std::vector<int> order, levels;
+		defrag_file_order(i, order, levels);
+		if(order.empty())
+			continue;
+		int runs = 1;
+		for(size_t k = 1; k < order.size(); k++){
+			if(order[k] == order[k - 1] + 1)
+				continue;
+			runs++;
+			info->seekblocks += std::abs(order[k] - order[k - 1] - 1);
 		}
+		info->files++;
+		info->blocks += order.size();
+		info->runs += runs;
+		info->breaks += runs - 1;
+		if(runs > 1)
+			info->fragmented++;
+		if(verbose)
+			std::cout << "inode " << i << ": " << order.size() << " blocks in " << runs << " runs, average run "
+				<< (double)order.size() / runs << " blocks" << std::endl;
 	}
 
-	Debug<DEFRAG_TRAIT>::msg("fs_defrag: ##### END #####");
+	//trechos livres da area de dados; a reserva da desfragmentacao eh espaco livre
+	defrag_reserve(false);
+	int run = 0;
+	for(int b = data_start(superblock); b <= superblock.nblocks; b++){
+		if(b < superblock.nblocks && data_bitmap[b] == 0){
+			run++;
+			continue;
+		}
+		if(run == 0)
+			continue;
+		int bucket = 0;
+		while(bucket < FS_FRAG_BUCKETS - 1 && (2 << bucket) <= run)
+			bucket++;
+		info->freehist[bucket]++;
+		info->freeruns++;
+		info->freeblocks += run;
+		info->largestfree = std::max(info->largestfree, run);
+		run = 0;
+	}
+	defrag_reserve(true);
+
+	if(verbose){
+		std::cout << info->files << " files, " << info->fragmented << " fragmented" << std::endl;
+		std::cout << info->blocks << " blocks in " << info->runs << " runs, average run "
+			<< (info->runs ? (double)info->blocks / info->runs : 0) << " blocks" << std::endl;
+		std::cout << info->breaks << " breaks between runs, " << (info->blocks ? 100.0 * info->breaks / info->blocks : 0)
+			<< " per 100 blocks" << std::endl;
+		std::cout << info->freeblocks << " free blocks in " << info->freeruns << " runs, largest " << info->largestfree << std::endl;
+		for(int k = 0; k < FS_FRAG_BUCKETS; k++)
+			if(info->freehist[k])
+				std::cout << "\tfree runs of " << (1 << k) << "-" << (2 << k) - 1 << " blocks: " << info->freehist[k] << std::endl;
+		std::cout << "defrag would save " << info->runs - info->files << " read requests and "
+			<< info->seekblocks << " blocks of seeking for a full read of every file" << std::endl;
+	}
 
 	return 1;
 }
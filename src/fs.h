@@ -1,9 +1,59 @@
 #ifndef FS_H
 #define FS_H
 
+#include <sys/uio.h>
+
+#define FS_FORMAT_FAST    1	// descarta a area de dados em vez de zerar bloco a bloco
+#define FS_FORMAT_EXTENTS 2	// inodos mapeiam os blocos por extents (inicio, tamanho)
+
+/*
+Resumo da fragmentacao, preenchido por fs_fraginfo(). Os blocos de um arquivo
+sao contados na ordem em que fs_defrag() os deixaria, com os indiretos. Os
+blocos reservados pela desfragmentacao em andamento contam como livres.
+*/
+#define FS_FRAG_BUCKETS 20
+
+struct fs_fraginfo {
+	int files;			// arquivos com pelo menos um bloco
+	int fragmented;			// arquivos com mais de um trecho
+	int blocks;			// blocos dos arquivos
+	int runs;			// trechos contiguos de todos os arquivos
+	int breaks;			// quebras entre trechos: trechos - 1 em cada arquivo
+	long seekblocks;		// distancia somada entre um trecho e o seguinte no mesmo arquivo
+	int freeblocks;
+	int freeruns;
+	int largestfree;
+	int freehist[FS_FRAG_BUCKETS];	// trechos livres com tamanho em [2^i, 2^(i+1))
+};
+
+/*
+Leitura sem copia, preenchida por fs_read_view(). Os trechos em iov apontam
+direto para os buffers do cache (fixados ate fs_release_view) ou para os
+blocos mapeados do disco; so quando nenhum dos dois eh possivel os dados sao
+copiados para copy. Uma view cobre no maximo FS_VIEW_BLOCKS blocos.
+
+Ate fs_release_view a view segura o arquivo para leitura: escritas nele, e
+format, mount, sync e desfragmentacao, esperam. Por isso a thread que pegou a
+view deve solta-la ela mesma, sem chamar outras funcoes do fs no meio.
+*/
+#define FS_VIEW_BLOCKS 64
+
+struct fs_view {
+	int count;				// trechos em iov
+	struct iovec iov[FS_VIEW_BLOCKS];
+	int npinned;
+	const char *pinned[FS_VIEW_BLOCKS];	// buffers do cache a soltar
+	char *copy;
+	void *lock;				// locks segurados ate fs_release_view
+};
+
+// todas as funcoes podem ser chamadas por varias threads ao mesmo tempo (veja
+// a excecao das views acima)
 void fs_debug();
-int  fs_format();
+int  fs_fraginfo( struct fs_fraginfo *info, int verbose );
+int  fs_format( int flags = 0 );
 int  fs_mount();
+int  fs_sync();
 
 int  fs_create();
 int  fs_delete( int inumber );
@@ -11,7 +61,19 @@ int  fs_getsize(int inumber);
 
 int  fs_read( int inumber, char *data, int length, int offset );
 int  fs_write( int inumber, const char *data, int length, int offset );
+int  fs_fallocate( int inumber, int offset, int length );
+
+// arquivos abertos: o handle guarda o mapa dos blocos do arquivo
+int  fs_open( int inumber );
+int  fs_close( int fd );
+int  fs_pread( int fd, char *data, int length, int offset );
+int  fs_pwrite( int fd, const char *data, int length, int offset );
+int  fs_read_view( int fd, int length, int offset, struct fs_view *view );
+void fs_release_view( struct fs_view *view );
 
 int fs_defrag ();
+int  fs_defrag_step( int max_moves, int max_ms );
+int  fs_defrag_start( int max_moves, int max_ms );
+void fs_defrag_stop();
 
 #endif
@@ -1,14 +1,19 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int do_copyout_fd( int inumber, int out );
+static int format_flag( const char *name, int *flags );
 
 int main( int argc, char *argv[] )
 {
@@ -16,19 +21,54 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
-	int inumber, result, args;
+	char arg3[1024];
+	int inumber, result, args, opt;
+	int nbuffers = CACHE_DEFAULT_BUFFERS;
+	int mode = DISK_MODE_FILE;
+	int model = DISK_MODEL_NONE;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	while((opt=getopt(argc,argv,"b:c:t:"))!=-1) {
+		switch(opt) {
+			case 'b':
+				if(!strcmp(optarg,"file")) mode = DISK_MODE_FILE;
+				else if(!strcmp(optarg,"mmap")) mode = DISK_MODE_MMAP;
+				else if(!strcmp(optarg,"ram")) mode = DISK_MODE_RAM;
+				else argc = 0;
+				break;
+			case 'c':
+				nbuffers = atoi(optarg);
+				break;
+			case 't':
+				if(!strcmp(optarg,"none")) model = DISK_MODEL_NONE;
+				else if(!strcmp(optarg,"hdd")) model = DISK_MODEL_HDD;
+				else if(!strcmp(optarg,"ssd")) model = DISK_MODEL_SSD;
+				else argc = 0;
+				break;
+			default:
+				argc = 0;
+				break;
+		}
+	}
+
+	if(argc-optind!=2) {
+		printf("use: %s [-b file|mmap|ram] [-c nbuffers] [-t none|hdd|ssd] <diskfile> <nblocks>\n",argv[0]);
+		return 1;
+	}
+
+	if(!disk_init(argv[optind],atoi(argv[optind+1]),mode)) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
-		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+	disk_set_model(model);
+
+	if(!cache_init(nbuffers)) {
+		printf("couldn't create a cache with %d buffers\n",nbuffers);
+		disk_close();
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	printf("opened emulated disk image %s with %d blocks\n",argv[optind],disk_size());
 
 	while(1) {
 		printf(" simplefs> ");
@@ -39,18 +79,19 @@ int main( int argc, char *argv[] )
 		if(line[0]=='\n') continue;
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+		args = sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3);
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
+			int flags = 0;
+			if((args<2 || format_flag(arg1,&flags)) && (args<3 || format_flag(arg2,&flags))) {
+				if(fs_format(flags)) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [fast] [extents]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
@@ -68,6 +109,16 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: debug\n");
 			}
+		} else if(!strcmp(cmd,"fraginfo")) {
+			if(args==1) {
+				struct fs_fraginfo info;
+				if(!fs_fraginfo(&info,1)) {
+					printf("fraginfo failed!\n");
+				}
+			} else {
+				printf("use: fraginfo\n");
+			}
+
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
 				inumber = atoi(arg1);
@@ -106,7 +157,8 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
 				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
+				fflush(stdout);
+				if(!do_copyout_fd(inumber,STDOUT_FILENO)) {
 					printf("cat failed!\n");
 				}
 			} else {
@@ -139,15 +191,18 @@ int main( int argc, char *argv[] )
 
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [fast] [extents]\n");
 			printf("    mount\n");
 			printf("    debug\n");
+			printf("    fraginfo\n");
 			printf("    create\n");
 			printf("    delete  <inode>\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
-			printf("    defrag\n");
+			printf("    defrag  [step|start <moves> <ms>] [stop]\n");
+			printf("    sync\n");
+			printf("    iostats [file]\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -160,8 +215,55 @@ int main( int argc, char *argv[] )
 				else{
 					printf("defragmentation failed\n");
 				}
+			} else if(args==4 && (atoi(arg2)<=0 || atoi(arg3)<=0) && (!strcmp(arg1,"step") || !strcmp(arg1,"start"))) {
+				printf("moves and ms must be at least 1\n");
+			} else if(args==4 && !strcmp(arg1,"step")) {
+				result = fs_defrag_step(atoi(arg2),atoi(arg3));
+				if(result>0) {
+					printf("defragmentation step done, more to do\n");
+				} else if(result==0) {
+					printf("defragmentation pass finished\n");
+				} else {
+					printf("defragmentation failed\n");
+				}
+			} else if(args==4 && !strcmp(arg1,"start")) {
+				result = fs_defrag_start(atoi(arg2),atoi(arg3));
+				if(result>0) {
+					printf("background defragmentation started\n");
+				} else if(result==0) {
+					printf("background defragmentation already running\n");
+				} else {
+					printf("defragmentation failed\n");
+				}
+			} else if(args==2 && !strcmp(arg1,"stop")) {
+				fs_defrag_stop();
+				printf("background defragmentation stopped\n");
 			} else {
-				printf("use: debug\n");
+				printf("use: defrag [step|start <moves> <ms>] [stop]\n");
+			}
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				fs_sync();
+				printf("disk synced.\n");
+			} else {
+				printf("use: sync\n");
+			}
+		} else if(!strcmp(cmd,"iostats")) {
+			if(args==1) {
+				disk_print_stats(stdout,0);
+				cache_print_stats(stdout);
+			} else if(args==2) {
+				FILE *file = fopen(arg1,"w");
+				if(file) {
+					disk_print_stats(file,1);
+					cache_print_stats(file);
+					fclose(file);
+					printf("statistics written to %s\n",arg1);
+				} else {
+					printf("couldn't open %s: %s\n",arg1,strerror(errno));
+				}
+			} else {
+				printf("use: iostats [file]\n");
 			}
 		} else if(!strcmp(cmd,"quit")) {
 			break;
@@ -175,6 +277,9 @@ int main( int argc, char *argv[] )
 	}
 
 	printf("closing emulated disk.\n");
+	fs_defrag_stop();
+	fs_sync();
+	cache_close();
 	disk_close();
 
 	return 0;
@@ -183,7 +288,7 @@ int main( int argc, char *argv[] )
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
+	int offset=0, result, actual, fd;
 	char buffer[16384];
 
 	file = fopen(filename,"r");
@@ -192,18 +297,31 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
+	fd = fs_open(inumber);
+	if(fd<0) {
+		fclose(file);
+		return 0;
+	}
+
+	// reserva o arquivo inteiro antes, para ele ficar contiguo no disco
+	if(fseek(file,0,SEEK_END)==0) {
+		long size = ftell(file);
+		if(size>0) fs_fallocate(inumber,0,size);
+		rewind(file);
+	}
+
 	while(1) {
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result<=0) break;
 		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+			actual = fs_pwrite(fd,buffer,result,offset);
 			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
+				printf("ERROR: fs_pwrite return invalid result %d\n",actual);
 				break;
 			}
 			offset += actual;
 			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				printf("WARNING: fs_pwrite only wrote %d bytes, not %d bytes\n",actual,result);
 				break;
 			}
 		}
@@ -211,31 +329,89 @@ static int do_copyin( const char *filename, int inumber )
 
 	printf("%d bytes copied\n",offset);
 
+	fs_close(fd);
 	fclose(file);
 	return 1;
 }
 
-static int do_copyout( int inumber, const char *filename )
+/* grava todos os trechos da view, continuando de onde um writev parcial parou */
+static int write_view( int out, struct fs_view *view )
 {
-	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
+	struct iovec *iov = view->iov;
+	int count = view->count;
+	ssize_t result;
 
-	file = fopen(filename,"w");
-	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
-		return 0;
+	while(count>0) {
+		result = writev(out,iov,count);
+		if(result<0) {
+			if(errno==EINTR) continue;
+			return 0;
+		}
+		while(count>0 && (size_t)result>=iov->iov_len) {
+			result -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count>0) {
+			iov->iov_base = (char *)iov->iov_base + result;
+			iov->iov_len -= result;
+		}
 	}
+	return 1;
+}
+
+/* os blocos do arquivo vao do cache (ou do disco mapeado) direto para out */
+static int do_copyout_fd( int inumber, int out )
+{
+	struct fs_view view;
+	int offset=0, result, fd, ok=1;
+
+	fd = fs_open(inumber);
+	if(fd<0) return 0;
 
 	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
+		result = fs_read_view(fd,FS_VIEW_BLOCKS*DISK_BLOCK_SIZE,offset,&view);
 		if(result<=0) break;
-		fwrite(buffer,1,result,file);
+		if(!write_view(out,&view)) {
+			printf("ERROR: couldn't write: %s\n",strerror(errno));
+			fs_release_view(&view);
+			ok = 0;
+			break;
+		}
+		fs_release_view(&view);
 		offset += result;
 	}
 
 	printf("%d bytes copied\n",offset);
 
-	fclose(file);
+	fs_close(fd);
+	return ok;
+}
+
+static int do_copyout( int inumber, const char *filename )
+{
+	int out, result;
+
+	out = open(filename,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if(out<0) {
+		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
+
+	result = do_copyout_fd(inumber,out);
+
+	close(out);
+	return result;
+}
+
+static int format_flag( const char *name, int *flags )
+{
+	if(!strcmp(name,"fast")) {
+		*flags |= FS_FORMAT_FAST;
+	} else if(!strcmp(name,"extents")) {
+		*flags |= FS_FORMAT_EXTENTS;
+	} else {
+		return 0;
+	}
 	return 1;
 }